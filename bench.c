@@ -0,0 +1,611 @@
+/* Copyright (C) 2012-2023 Dimitris Papavasiliou, Boris Nagaev
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* A benchmark suite for the pretty-printer and the other hot paths
+ * of the prompt, that is completion and the read-eval-print loop.
+ * It is built with "make bench" and links prompt.c directly.  For
+ * each case it prints the time per operation, as well as the number
+ * of heap allocations made per operation, both by the C library and
+ * by Lua, one case per line, in a format that is meant to be easy to
+ * compare across builds. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <readline/readline.h>
+
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "prompt.h"
+
+static unsigned long c_allocations, lua_allocations;
+
+#ifdef __GLIBC__
+/* Count the allocations made through the C library by interposing
+ * malloc and friends. */
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *p, size_t size);
+
+void *malloc (size_t size)
+{
+    c_allocations += 1;
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t n, size_t size)
+{
+    c_allocations += 1;
+    return __libc_calloc (n, size);
+}
+
+void *realloc (void *p, size_t size)
+{
+    c_allocations += 1;
+    return __libc_realloc (p, size);
+}
+#endif
+
+static void *allocate (void *ud, void *p, size_t osize, size_t nsize)
+{
+    unsigned long c;
+
+    if (nsize == 0) {
+        free (p);
+        return NULL;
+    }
+
+    if (!p || nsize > osize) {
+        lua_allocations += 1;
+    }
+
+    /* Don't count Lua's allocations twice. */
+
+    c = c_allocations;
+    p = realloc (p, nsize);
+    c_allocations = c;
+
+    return p;
+}
+
+static double now ()
+{
+    struct timespec t;
+
+    clock_gettime (CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void describe (lua_State *L)
+{
+    luap_describe (L, -1);
+}
+
+static void describe_references (lua_State *L)
+{
+    luap_setreferences (L, 1);
+    luap_describe (L, -1);
+    luap_setreferences (L, 0);
+}
+
+static void describe_columnar (lua_State *L)
+{
+    luap_setcolumnar (L, 1);
+    luap_describe (L, -1);
+    luap_setcolumnar (L, 0);
+}
+
+static void describe_raw (lua_State *L)
+{
+    luap_setraw (L, 1);
+    luap_describe (L, -1);
+    luap_setraw (L, 0);
+}
+
+static int tostring (lua_State *L)
+{
+    lua_pushliteral (L, "<bench userdata>");
+
+    return 1;
+}
+
+static int newuserdata (lua_State *L)
+{
+    lua_newuserdata (L, sizeof (int));
+
+    if (luaL_newmetatable (L, "bench.userdata")) {
+        lua_pushcfunction (L, tostring);
+        lua_setfield (L, -2, "__tostring");
+    }
+
+    lua_setmetatable (L, -2);
+
+    return 1;
+}
+
+/* Vectors are userdata holding three numbers, shown either through a
+ * __tostring metamethod, or by a native describer, as a table with a
+ * field per coordinate. */
+
+static int vector_tostring (lua_State *L)
+{
+    double *v = (double *)lua_touserdata (L, 1);
+
+    lua_pushfstring (L, "{ x = %f, y = %f, z = %f }", v[0], v[1], v[2]);
+
+    return 1;
+}
+
+static void describe_vector (luap_Describer *D, lua_State *L, int index)
+{
+    static const char *names[] = {"x", "y", "z"};
+    double *v = (double *)lua_touserdata (L, index);
+    int i;
+
+    luap_describer_open (D);
+
+    for (i = 0 ; i < 3 ; i += 1) {
+        lua_pushnumber (L, v[i]);
+        luap_describer_field (D, L, names[i], -1);
+        lua_pop (L, 1);
+    }
+
+    luap_describer_close (D);
+}
+
+static int newvector (lua_State *L)
+{
+    double *v;
+    int i;
+
+    v = (double *)lua_newuserdata (L, 3 * sizeof (double));
+
+    for (i = 0 ; i < 3 ; i += 1) {
+        v[i] = luaL_checknumber (L, i + 1);
+    }
+
+    if (lua_toboolean (L, 4)) {
+        if (luaL_newmetatable (L, "bench.nativevector")) {
+            luap_register_describer (L, -1, describe_vector);
+        }
+    } else if (luaL_newmetatable (L, "bench.vector")) {
+        lua_pushcfunction (L, vector_tostring);
+        lua_setfield (L, -2, "__tostring");
+    }
+
+    lua_setmetatable (L, -2);
+
+    return 1;
+}
+
+/* Completion is measured by generating all matches for some text,
+ * which is left on the stack by the setup chunk, as readline would
+ * when the completion key is pressed. */
+
+static void complete (lua_State *L)
+{
+    char **matches;
+    int i;
+
+    matches = rl_completion_matches (lua_tostring (L, -1),
+                                     rl_completion_entry_function);
+
+    if (matches) {
+        for (i = 0 ; matches[i] ; i += 1) {
+            free (matches[i]);
+        }
+
+        free (matches);
+    }
+}
+
+/* The read-eval-print loop is measured by feeding it the script left
+ * on the stack by the setup chunk, with its output discarded. */
+
+static void enter (lua_State *L)
+{
+    const char *s;
+    size_t n;
+    int fd;
+
+    /* Readline needs a stream backed by a file descriptor. */
+
+    s = lua_tolstring (L, -1, &n);
+    rl_instream = tmpfile ();
+    fwrite (s, sizeof (char), n, rl_instream);
+    rewind (rl_instream);
+
+    fflush (stdout);
+    fd = dup (STDOUT_FILENO);
+    dup2 (open ("/dev/null", O_WRONLY), STDOUT_FILENO);
+
+    luap_enter (L);
+
+    fflush (stdout);
+    dup2 (fd, STDOUT_FILENO);
+    close (fd);
+
+    fclose (rl_instream);
+    rl_instream = NULL;
+}
+
+/* This is the byte-at-a-time string escaping loop, which was used by
+ * the pretty-printer before it learned to copy runs of plain
+ * characters in bulk.  It is kept here to serve as a baseline. */
+
+static char *dump;
+static size_t length, offset;
+static int column;
+
+static void check_fit (size_t size)
+{
+    if (offset + size + 1 > length) {
+        length = offset + size + 1;
+        dump = (char *)realloc (dump, length);
+    }
+}
+
+static int width (const char *s)
+{
+    const char *c;
+    int n, discard = 0;
+
+    for (c = s, n = 0 ; *c ; c += 1) {
+        if (!discard && *c == '\033') {
+            discard = 1;
+        }
+
+        if (!discard) {
+            n+= 1;
+        }
+
+        if (discard && *c == 'm') {
+            discard = 0;
+        }
+    }
+
+    return n;
+}
+
+#define dump_literal(s) (check_fit(sizeof(s) - 1),      \
+                         strcpy (dump + offset, s),     \
+                         offset += sizeof(s) - 1,       \
+                         column += width(s))
+
+#define dump_character(c) (check_fit(1),                \
+                           dump[offset] = c,            \
+                           offset += 1,                 \
+                           column += 1)
+
+static void escape_bytewise (lua_State *L)
+{
+    const char *s;
+    size_t i, n;
+
+    s = lua_tolstring (L, -1, &n);
+    offset = column = 0;
+
+    for (i = 0 ; i < n ; i += 1) {
+        if (s[i] == '"' || s[i] == '\\') {
+            dump_literal ("\\");
+            dump_character (s[i]);
+        } else if (s[i] == '\a') {
+            dump_literal ("\\a");
+        } else if (s[i] == '\b') {
+            dump_literal ("\\b");
+        } else if (s[i] == '\f') {
+            dump_literal ("\\f");
+        } else if (s[i] == '\n') {
+            dump_literal ("\\n");
+        } else if (s[i] == '\r') {
+            dump_literal ("\\r");
+        } else if (s[i] == '\t') {
+            dump_literal ("\\t");
+        } else if (s[i] == '\v') {
+            dump_literal ("\\v");
+        } else if (isprint(s[i])) {
+            dump_character (s[i]);
+        } else {
+            char t[5];
+            size_t m;
+
+            m = sprintf (t, "\\%03u", ((unsigned char *)s)[i]);
+            check_fit (m);
+            memcpy (dump + offset, t, m);
+            offset += m;
+            column += width (t);
+        }
+    }
+}
+
+static void run (lua_State *L, const char *name, const char *setup,
+                 void (*f) (lua_State *), int n)
+{
+    unsigned long c, l;
+    double t;
+    int i;
+
+    /* Create the value to be described by running the setup chunk. */
+
+    if (luaL_dostring (L, setup)) {
+        fprintf (stderr, "%s: %s\n", name, lua_tostring (L, -1));
+        exit (EXIT_FAILURE);
+    }
+
+    /* Warm up, so that the retained buffer is already in place. */
+
+    f (L);
+
+    c = c_allocations;
+    l = lua_allocations;
+    t = now ();
+
+    for (i = 0 ; i < n ; i += 1) {
+        f (L);
+    }
+
+    t = now () - t;
+    c = c_allocations - c;
+    l = lua_allocations - l;
+
+    printf ("%-32s %14.0f ns/op %12.1f allocs/op %12.1f lua-allocs/op\n",
+            name, t / n, (double)c / n, (double)l / n);
+
+    lua_pop (L, 1);
+}
+
+int main (int argc, char **argv)
+{
+    lua_State *L;
+
+    L = lua_newstate (allocate, NULL);
+    luaL_openlibs (L);
+    luap_setcolor (L, 0);
+
+    lua_pushcfunction (L, newuserdata);
+    lua_setglobal (L, "newuserdata");
+    lua_pushcfunction (L, newvector);
+    lua_setglobal (L, "newvector");
+
+    /* Enter the prompt once with no input, to initialize it. */
+
+    lua_pushliteral (L, "");
+    enter (L);
+    lua_pop (L, 1);
+
+    run (L, "describe/flat-10k",
+         "local t = {}\n"
+         "for i = 1, 10000 do t[i] = i; t['k' .. i] = 'v' .. i end\n"
+         "return t", describe, 20);
+
+    run (L, "describe/flat-1M",
+         "local t = {}\n"
+         "for i = 1, 1000000 do t[i] = i; t['k' .. i] = 'v' .. i end\n"
+         "return t", describe, 1);
+
+    run (L, "describe/array-1M",
+         "local t = {}\n"
+         "for i = 1, 1000000 do t[i] = i end\n"
+         "return t", describe, 1);
+
+    /* An array with an __index metamethod, which counts its calls,
+     * read through it and directly. */
+
+    run (L, "describe/proxied-100k",
+         "local t = {}\n"
+         "for i = 1, 100000 do t[i] = i end\n"
+         "return setmetatable(t, {__index = function (t, k)\n"
+         "  misses = (misses or 0) + 1\n"
+         "end})", describe, 10);
+
+    run (L, "describe/proxied-100k-raw",
+         "local t = {}\n"
+         "for i = 1, 100000 do t[i] = i end\n"
+         "return setmetatable(t, {__index = function (t, k)\n"
+         "  misses = (misses or 0) + 1\n"
+         "end})", describe_raw, 10);
+
+    /* Tables indexed by IDs outside the array part, sparse and in
+     * runs of equal values respectively. */
+
+    run (L, "describe/sparse-ids-100k",
+         "local t = {}\n"
+         "for i = 1, 100000 do t[1000000 + i * 7] = i end\n"
+         "return t", describe, 10);
+
+    run (L, "describe/id-runs-1M",
+         "local t = {}\n"
+         "for i = 1, 1000000 do t[1000000 + i] = math.floor(i / 1000) end\n"
+         "return t", describe, 1);
+
+    run (L, "describe/deep-1000",
+         "local t = {}\n"
+         "for i = 1, 1000 do t = {t, n = i} end\n"
+         "return t", describe, 1000);
+
+    run (L, "describe/nested-records-10k",
+         "local t = {}\n"
+         "for i = 1, 10000 do\n"
+         "  t[i] = {id = i, name = 'item' .. i, tags = {'a', 'b'},\n"
+         "          pos = {x = i, y = -i}}\n"
+         "end\n"
+         "return t", describe, 10);
+
+    run (L, "describe/records-10k",
+         "local t = {}\n"
+         "for i = 1, 10000 do\n"
+         "  t[i] = {host = '10.0.' .. i % 256 .. '.' .. i % 7, port = 1000 + i,\n"
+         "          state = i % 3 == 0 and 'open' or 'closed', pid = i * 13}\n"
+         "end\n"
+         "return t", describe, 10);
+
+    run (L, "describe/records-10k-columnar",
+         "local t = {}\n"
+         "for i = 1, 10000 do\n"
+         "  t[i] = {host = '10.0.' .. i % 256 .. '.' .. i % 7, port = 1000 + i,\n"
+         "          state = i % 3 == 0 and 'open' or 'closed', pid = i * 13}\n"
+         "end\n"
+         "return t", describe_columnar, 10);
+
+    /* A ring of nodes, linked in both directions. */
+
+    run (L, "describe/cyclic-ring-1k",
+         "local t = {}\n"
+         "for i = 1, 1000 do t[i] = {id = i} end\n"
+         "for i = 1, 1000 do\n"
+         "  t[i].next = t[i % 1000 + 1]; t[i % 1000 + 1].prev = t[i]\n"
+         "end\n"
+         "return t", describe, 10);
+
+    run (L, "describe/cyclic-ring-1k-refs",
+         "local t = {}\n"
+         "for i = 1, 1000 do t[i] = {id = i} end\n"
+         "for i = 1, 1000 do\n"
+         "  t[i].next = t[i % 1000 + 1]; t[i % 1000 + 1].prev = t[i]\n"
+         "end\n"
+         "return t", describe_references, 10);
+
+    run (L, "describe/integers-100k",
+         "local t = {}\n"
+         "for i = 1, 100000 do t[i] = i * 7919 % 1000003 end\n"
+         "return t", describe, 10);
+
+    run (L, "describe/floats-100k",
+         "local t = {}\n"
+         "for i = 1, 100000 do t[i] = i / 7 end\n"
+         "return t", describe, 10);
+
+    run (L, "describe/booleans-100k",
+         "local t = {}\n"
+         "for i = 1, 100000 do t[i] = i % 3 == 0 end\n"
+         "return t", describe, 10);
+
+    run (L, "describe/closures-10k",
+         "local t = {}\n"
+         "for i = 1, 10000 do t[i] = function () return i end end\n"
+         "return t", describe, 10);
+
+    run (L, "describe/deep-cut-10k",
+         "local t = {}\n"
+         "for i = 1, 10000 do\n"
+         "  t[i] = {{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{{}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}}\n"
+         "end\n"
+         "return t", describe, 10);
+
+    run (L, "describe/userdata-tostring-10k",
+         "local t = {}\n"
+         "for i = 1, 10000 do t[i] = newuserdata() end\n"
+         "return t", describe, 10);
+
+    run (L, "describe/vectors-100k-tostring",
+         "local t = {}\n"
+         "for i = 1, 100000 do t[i] = newvector(i, 2 * i, 0.5) end\n"
+         "return t", describe, 5);
+
+    run (L, "describe/vectors-100k-native",
+         "local t = {}\n"
+         "for i = 1, 100000 do t[i] = newvector(i, 2 * i, 0.5, true) end\n"
+         "return t", describe, 5);
+
+    /* Strings of 1 MiB, that are printed as a long string, as an
+     * escaped string with runs of plain characters and as an escaped
+     * string of random bytes respectively. */
+
+    run (L, "describe/string-plain",
+         "return string.rep('All work and no play. ', math.floor(2 ^ 20 / 22))",
+         describe, 20);
+
+    run (L, "describe/string-mixed",
+         "return string.rep('id=42 status=\"ok\"\\0\\27', math.floor(2 ^ 20 / 19))",
+         describe, 20);
+
+    run (L, "escape-bytewise/string-mixed",
+         "return string.rep('id=42 status=\"ok\"\\0\\27', math.floor(2 ^ 20 / 19))",
+         escape_bytewise, 20);
+
+    run (L, "describe/string-binary",
+         "local t = {}\n"
+         "for i = 1, 2 ^ 20 do t[i] = string.char(math.random(0, 255)) end\n"
+         "return table.concat(t)",
+         describe, 20);
+
+    run (L, "escape-bytewise/string-binary",
+         "local t = {}\n"
+         "for i = 1, 2 ^ 20 do t[i] = string.char(math.random(0, 255)) end\n"
+         "return table.concat(t)",
+         escape_bytewise, 20);
+
+    /* Completion of global variables, table keys (from a table with
+     * many keys) and module names. */
+
+    run (L, "complete/globals",
+         "return 's'", complete, 1000);
+
+    run (L, "complete/table-keys",
+         "return 'string.'", complete, 1000);
+
+    run (L, "complete/table-keys-10k",
+         "bench_keys = {}\n"
+         "for i = 1, 10000 do bench_keys['key' .. i] = i end\n"
+         "return 'bench_keys.key1'", complete, 100);
+
+    run (L, "complete/table-keys-100k-narrow",
+         "bench_wide = {}\n"
+         "for i = 1, 100000 do bench_wide['key' .. i] = i end\n"
+         "return 'bench_wide.key9999'", complete, 100);
+
+    run (L, "complete/nested-path",
+         "bench_tree = {a = {b = {c = {d = {e = {value = 1, values = 2}}}}}}\n"
+         "return 'bench_tree.a.b.c[\"d\"].e.val'", complete, 1000);
+
+    run (L, "complete/modules",
+         "return 'str'", complete, 100);
+
+    run (L, "complete/modules-quoted",
+         "return \"'s\"", complete, 100);
+
+    /* The read-eval-print loop, on a script of 100 lines. */
+
+    run (L, "eval/script-100-lines",
+         "local t = {}\n"
+         "for i = 1, 20 do\n"
+         "  t[#t + 1] = 'x = ' .. i\n"
+         "  t[#t + 1] = 'x + 1'\n"
+         "  t[#t + 1] = 'local s = string.rep(\"a\", x)'\n"
+         "  t[#t + 1] = '{x, y = {x}, \"z\"}'\n"
+         "  t[#t + 1] = 'for i = 1, 10 do x = x + i end'\n"
+         "end\n"
+         "return table.concat(t, '\\n') .. '\\n'", enter, 100);
+
+    lua_close (L);
+
+    return 0;
+}
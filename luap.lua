@@ -207,6 +207,7 @@ if interactive then
    prompt.prompts = {'>  ', '>> '}
    prompt.colorize = not args.p
    prompt.history = os.getenv('HOME') .. '/.lua_history'
+   prompt.moduleindex = os.getenv('HOME') .. '/.luap_modules'
 
    for _, name in ipairs{os.getenv('HOME') .. '/.luaprc.lua',
                          os.getenv('HOME') .. '/.config/luaprc.lua'} do
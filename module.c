@@ -21,6 +21,7 @@
  * SOFTWARE.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -33,9 +34,113 @@
 #define LUA_OK 0
 #endif
 
+static FILE *tofile (lua_State *L, int i)
+{
+    FILE *f = NULL;
+
+    /* Both in Lua 5.1, where file handles are FILE pointers, and in
+     * later versions, where they're luaL_Streams, the FILE pointer
+     * comes first. */
+
+    if (lua_getmetatable(L, i)) {
+        luaL_getmetatable(L, LUA_FILEHANDLE);
+
+        if (lua_rawequal(L, -1, -2)) {
+            f = *(FILE **)lua_touserdata(L, i);
+
+#if LUA_VERSION_NUM > 501
+            if (((luaL_Stream *)lua_touserdata(L, i))->closef == NULL) {
+                f = NULL;
+            }
+#endif
+            if (!f) {
+                luaL_argerror(L, i, "attempt to use a closed file");
+            }
+        }
+
+        lua_pop(L, 2);
+    }
+
+    if (!f) {
+        luaL_argerror(L, i, "file expected");
+    }
+
+    return f;
+}
+
 static int describe (lua_State *L)
 {
-    lua_pushstring(L, luap_describe(L, 1));
+    luaL_checkany(L, 1);
+
+    if (!lua_isnoneornil(L, 2)) {
+        /* Write the description to the supplied file. */
+
+        if (luap_describe_to(L, 1, luap_filewriter, tofile(L, 2)) != 0) {
+            return luaL_error(L, "could not write to file");
+        }
+
+        lua_settop(L, 2);
+    } else {
+        lua_State *T;
+        luaL_Buffer b;
+
+        /* Collect the description in a buffer.  The buffer lives on
+         * a separate thread, so that the traversal is free to use
+         * the stack in the meantime. */
+
+        T = lua_newthread(L);
+        luaL_buffinit(T, &b);
+        luap_describe_to(L, 1, luap_bufferwriter, &b);
+        luaL_pushresult(&b);
+        lua_xmove(T, L, 1);
+    }
+
+    return 1;
+}
+
+static int expand (lua_State *L)
+{
+    /* Describe the table behind a handle, as in describe above. */
+
+    if (!luap_expand(L, (int)luaL_checkinteger(L, 1))) {
+        return luaL_argerror(L, 1, "invalid handle");
+    }
+
+    lua_replace(L, 1);
+
+    return describe(L);
+}
+
+static int dump (lua_State *L)
+{
+    const char *format;
+
+    luaL_checkany(L, 1);
+    format = luaL_optstring(L, 2, "lua");
+
+    if (!lua_isnoneornil(L, 3)) {
+        if (luap_dump(L, 1, format, luap_filewriter, tofile(L, 3)) != 0) {
+            return lua_error(L);
+        }
+
+        lua_settop(L, 3);
+    } else {
+        lua_State *T;
+        luaL_Buffer b;
+
+        /* As in describe above. */
+
+        T = lua_newthread(L);
+        luaL_buffinit(T, &b);
+
+        if (luap_dump(L, 1, format, luap_bufferwriter, &b) != 0) {
+            return lua_error(L);
+        }
+
+        luaL_pushresult(&b);
+        lua_xmove(T, L, 1);
+    }
+
     return 1;
 }
 
@@ -59,6 +164,10 @@ static int call (lua_State *L)
     return lua_gettop(L);
 }
 
+static const char *limit_names[] = {
+    "entries", "depth", "string", "total", "steps"
+};
+
 static void update_index (lua_State *L)
 {
     const char *k;
@@ -101,11 +210,69 @@ static void update_index (lua_State *L)
         } else {
             lua_pushboolean(L, 0);
         }
+    } else if (!strcmp(k, "moduleindex")) {
+        const char *index;
+
+        luap_getmoduleindex(L, &index);
+
+        if (index) {
+            lua_pushstring(L, index);
+        } else {
+            lua_pushboolean(L, 0);
+        }
     } else if (!strcmp(k, "name")) {
         const char *name;
 
         luap_getname(L, &name);
         lua_pushstring(L, name);
+    } else if (!strcmp(k, "references")) {
+        int references;
+
+        luap_getreferences(L, &references);
+        lua_pushboolean(L, references);
+    } else if (!strcmp(k, "roundtrip")) {
+        int roundtrip;
+
+        luap_getroundtrip(L, &roundtrip);
+        lua_pushboolean(L, roundtrip);
+    } else if (!strcmp(k, "raw")) {
+        int raw;
+
+        luap_getraw(L, &raw);
+        lua_pushboolean(L, raw);
+    } else if (!strcmp(k, "columnar")) {
+        int columnar;
+
+        luap_getcolumnar(L, &columnar);
+        lua_pushboolean(L, columnar);
+    } else if (!strcmp(k, "pager")) {
+        int pager;
+
+        luap_getpager(L, &pager);
+        lua_pushboolean(L, pager);
+    } else if (!strcmp(k, "collapse")) {
+        int collapse;
+
+        luap_getcollapse(L, &collapse);
+
+        if (collapse > 0) {
+            lua_pushinteger(L, collapse);
+        } else {
+            lua_pushboolean(L, 0);
+        }
+    } else if (!strcmp(k, "limits")) {
+        int limits[5], i;
+
+        luap_getlimits(L, &limits[0], &limits[1], &limits[2], &limits[3],
+                       &limits[4]);
+        lua_newtable(L);
+
+        for (i = 0 ; i < 5 ; i += 1) {
+            if (limits[i] > 0) {
+                lua_pushinteger(L, limits[i]);
+                lua_setfield(L, -2, limit_names[i]);
+            }
+        }
     }
 
     /* Update the __index table. */
@@ -150,8 +317,37 @@ static int prompt_newindex (lua_State *L)
         luap_setcolor(L, lua_toboolean(L, 3));
     } else if (!strcmp(k, "history")) {
         luap_sethistory(L, lua_tostring(L, 3));
+    } else if (!strcmp(k, "moduleindex")) {
+        luap_setmoduleindex(L, lua_tostring(L, 3));
     } else if (!strcmp(k, "name")) {
         luap_setname(L, lua_tostring(L, 3));
+    } else if (!strcmp(k, "references")) {
+        luap_setreferences(L, lua_toboolean(L, 3));
+    } else if (!strcmp(k, "roundtrip")) {
+        luap_setroundtrip(L, lua_toboolean(L, 3));
+    } else if (!strcmp(k, "raw")) {
+        luap_setraw(L, lua_toboolean(L, 3));
+    } else if (!strcmp(k, "columnar")) {
+        luap_setcolumnar(L, lua_toboolean(L, 3));
+    } else if (!strcmp(k, "pager")) {
+        luap_setpager(L, lua_toboolean(L, 3));
+    } else if (!strcmp(k, "collapse")) {
+        luap_setcollapse(L, lua_tointeger(L, 3));
+    } else if (!strcmp(k, "limits")) {
+        int limits[5] = {0, 0, 0, 0, 0}, i;
+
+        /* Missing limits are lifted. */
+
+        if (lua_istable(L, 3)) {
+            for (i = 0 ; i < 5 ; i += 1) {
+                lua_getfield(L, 3, limit_names[i]);
+                limits[i] = lua_tointeger(L, -1);
+                lua_pop(L, 1);
+            }
+        }
+
+        luap_setlimits(L, limits[0], limits[1], limits[2], limits[3],
+                       limits[4]);
     } else {
         lua_rawset (L, 1);
         return 0;
@@ -168,6 +364,8 @@ static int prompt_newindex (lua_State *L)
 int luaopen_prompt(lua_State* L) {
     static const luaL_Reg functions[] = {
         {"describe", describe},
+        {"expand", expand},
+        {"dump", dump},
         {"call", call},
         {"enter", enter},
         {NULL, NULL},
@@ -237,9 +435,33 @@ int luaopen_prompt(lua_State* L) {
     lua_pushliteral(L, "history");
     update_index(L);
 
+    lua_pushliteral(L, "moduleindex");
+    update_index(L);
+
     lua_pushliteral(L, "name");
     update_index(L);
 
+    lua_pushliteral(L, "limits");
+    update_index(L);
+
+    lua_pushliteral(L, "references");
+    update_index(L);
+
+    lua_pushliteral(L, "roundtrip");
+    update_index(L);
+
+    lua_pushliteral(L, "raw");
+    update_index(L);
+
+    lua_pushliteral(L, "columnar");
+    update_index(L);
+
+    lua_pushliteral(L, "collapse");
+    update_index(L);
+
+    lua_pushliteral(L, "pager");
+    update_index(L);
+
 #if LUA_VERSION_NUM != 501
     luaL_setfuncs(L, functions, 0);
 #endif
@@ -28,17 +28,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <ctype.h>
+#include <wchar.h>
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <termios.h>
 #include <signal.h>
 #include <setjmp.h>
 
+#ifdef DISCOVER_MODULES
+#include <pthread.h>
+#endif
+
 #ifdef HAVE_IOCTL
 #include <sys/ioctl.h>
 #endif
 
-#include <glob.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <lualib.h>
 #include <lauxlib.h>
@@ -103,9 +119,14 @@ static char *readline(char *prompt)
 
 static lua_State *M;
 static int initialized = 0;
-static char *logfile, *chunkname, *prompts[2][2], *buffer = NULL;
+static char *logfile, *indexfile, *chunkname, *prompts[2][2], *buffer = NULL;
 static int prompt_funcs[2] = {LUA_REFNIL, LUA_REFNIL};
 
+/* This is bumped whenever a new line is read, or a module is loaded
+ * during completion, as the available keys may then have changed. */
+
+static unsigned int generation;
+
 #ifdef SAVE_RESULTS
 static int results = LUA_REFNIL, results_n = 0;
 #endif
@@ -121,12 +142,41 @@ static const char *colors[] = {"\033[0m",
                                "\033[1m",
                                "\033[22m"};
 
+/* The state of the pretty-printer is kept in a luap_Describer, so
+ * that several values can be described at once, either by different
+ * threads, or by __tostring metamethods that describe values
+ * themselves.  The describer below is used by luap_describe and
+ * luap_describe_to and its options are the ones set via the
+ * luap_set* calls. */
+
+static luap_Describer describer;
+
 static sigjmp_buf before_readline;
 
 void handle_interrupt(int signo) {
     siglongjmp(before_readline, 1);
 }
 
+/* While the results are being described, SIGINT just raises a flag,
+ * which is checked by the pretty-printer.  Any Lua code that happens
+ * to be running, such as a __tostring metamethod, is interrupted via
+ * a hook, much like the standalone interpreter does. */
+
+static volatile sig_atomic_t interrupted;
+
+static void stop_hook (lua_State *L, lua_Debug *ar)
+{
+    lua_sethook (L, NULL, 0, 0);
+    luaL_error (L, "interrupted!");
+}
+
+static void handle_describe_interrupt(int signo)
+{
+    interrupted = 1;
+    lua_sethook (M, stop_hook,
+                 LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+}
+
 #ifdef HAVE_LIBREADLINE
 
 static void display_matches (char **matches, int num_matches, int max_length)
@@ -175,1216 +225,5743 @@ static char *keyword_completions (const char *text, int state)
 
 static int look_up_metatable;
 
-static char *table_key_completions (const char *text, int state)
+/* Completing the keys of a huge table, such as the global table,
+ * would take time proportional to its size on each press of the
+ * completion key.  Instead, the keys of each table are collected into
+ * an index the first time they're completed, sorted so that the
+ * matches for a token can be found by binary search.  The indices are
+ * dropped as soon as the keys might have changed, that is when a new
+ * line is read, or a module is loaded.  Each index holds a reference
+ * to its table, so that the table's address isn't reused meanwhile. */
+
+#define KEY_INDICES 8
+
+typedef struct {
+    char *key;
+    size_t length;
+    int number, type, keytype;
+} IndexedKey;
+
+typedef struct {
+    const void *table;
+    int reference, metatable, length, size;
+    IndexedKey *keys;
+} KeyIndex;
+
+static KeyIndex indices[KEY_INDICES];
+static int next_index;
+static unsigned int indices_generation;
+
+static void drop_index (KeyIndex *K)
 {
-    static const char *c, *token;
-    static char oper;
-    static int h;
+    int i;
 
-    if (state == 0) {
-        h = lua_gettop(M);
+    for (i = 0 ; i < K->length ; i += 1) {
+        free (K->keys[i].key);
+    }
 
-        /* Scan to the beginning of the to-be-completed token. */
+    free (K->keys);
 
-        for (c = text + strlen (text) - 1;
-             c >= text && *c != '.' && *c != ':' && *c != '[';
-             c -= 1);
+    if (K->table) {
+        luaL_unref (M, LUA_REGISTRYINDEX, K->reference);
+    }
 
-        if (c > text) {
-            oper = *c;
-            token = c + 1;
+    memset (K, 0, sizeof (KeyIndex));
+}
 
-            /* Get the iterable value, the keys of which we wish to
-             * complete. */
+static int compare_indexed_keys (const void *a, const void *b)
+{
+    const IndexedKey *x = (const IndexedKey *)a, *y = (const IndexedKey *)b;
+    int d;
 
-            lua_pushliteral (M, "return ");
-            lua_pushlstring (M, text, token - text - 1);
-            lua_concat (M, 2);
+    /* Sort numbers after strings and each in lexicographic order. */
 
-            if (luaL_loadstring (M, lua_tostring (M, -1)) ||
-                lua_pcall (M, 0, 1, 0) ||
-                (lua_type (M, -1) != LUA_TUSERDATA &&
-                 lua_type (M, -1) != LUA_TTABLE)) {
+    if (x->number != y->number) {
+        return x->number - y->number;
+    }
 
-                lua_settop(M, h);
-                return NULL;
-            }
-        } else {
-            oper = 0;
-            token = text;
+    d = memcmp (x->key, y->key, x->length < y->length ? x->length : y->length);
 
-            lua_pushglobaltable(M);
+    if (d != 0) {
+        return d;
+    }
+
+    return (x->length > y->length) - (x->length < y->length);
+}
+
+static void add_key (KeyIndex *K)
+{
+    IndexedKey *k;
+    const char *s;
+    char t[32];
+    size_t l;
+
+    /* Add the key-value pair on the top of the stack to the index.
+     * Keep notes about the value, which will be needed when it's
+     * completed.  Only string keys and integer keys are of
+     * interest. */
+
+    if (lua_type (M, -2) == LUA_TSTRING) {
+        s = lua_tolstring (M, -2, &l);
+    } else if (lua_type (M, -2) == LUA_TNUMBER) {
+        lua_Number n;
+        int i;
+
+        n = lua_tonumber (M, -2);
+        i = lua_tointeger (M, -2);
+
+        if ((lua_Number)i != n) {
+            return;
         }
 
-        if (look_up_metatable) {
-            /* Replace the to-be-iterated value with it's metatable
-             * and set up a call to next. */
+        l = sprintf (t, "%d", i);
+        s = t;
+    } else {
+        return;
+    }
 
-            if (!luaL_getmetafield(M, -1, "__index") ||
-                (lua_type (M, -1) != LUA_TUSERDATA &&
-                 lua_type (M, -1) != LUA_TTABLE)) {
-                lua_settop(M, h);
-                return NULL;
-            }
+    if (K->length == K->size) {
+        K->size = K->size > 0 ? 2 * K->size : 64;
+        K->keys = (IndexedKey *)realloc (K->keys, K->size * sizeof (IndexedKey));
+    }
 
-            lua_getglobal(M, "next");
-            lua_replace(M, -3);
-            lua_pushnil(M);
-        } else {
-            /* Call the standard pairs function. */
+    k = &K->keys[K->length];
+    K->length += 1;
 
-            lua_getglobal (M, "pairs");
-            lua_insert (M, -2);
+    k->key = (char *)malloc (l + 1);
+    memcpy (k->key, s, l + 1);
+    k->length = l;
+    k->number = (s == t);
+    k->type = lua_type (M, -1);
+    k->keytype = LUA_TNIL;
 
-            if(lua_type (M, -2) != LUA_TFUNCTION ||
-               lua_pcall (M, 1, 3, 0)) {
+    if (k->type == LUA_TTABLE) {
+        lua_pushnil(M);
 
-                lua_settop(M, h);
-                return NULL;
-            }
+        if (lua_next(M, -2)) {
+            k->keytype = lua_type (M, -2);
+            lua_pop (M, 2);
         }
     }
+}
 
-    /* Iterate the table/userdata and generate matches. */
+static KeyIndex *find_index (void)
+{
+    KeyIndex *K;
+    int i, h;
 
-    while (lua_pushvalue(M, -3), lua_insert (M, -3),
-           lua_pushvalue(M, -2), lua_insert (M, -4),
-           lua_pcall (M, 2, 2, 0) == 0) {
-        char *candidate;
-        size_t l, m;
-        int suppress, type, keytype;
+    /* Find the index of the keys of the value on the top of the stack,
+     * or build it if there isn't one. */
+
+    if (indices_generation != generation) {
+        for (i = 0 ; i < KEY_INDICES ; i += 1) {
+            drop_index (&indices[i]);
+        }
+
+        indices_generation = generation;
+    }
 
-        if (lua_isnil(M, -2)) {
+    for (i = 0 ; i < KEY_INDICES ; i += 1) {
+        if (indices[i].table == lua_topointer (M, -1) &&
+            indices[i].metatable == look_up_metatable) {
+            return &indices[i];
+        }
+    }
+
+    h = lua_gettop(M);
+
+    if (look_up_metatable) {
+        /* Push the value's metatable and set up a call to next. */
+
+        if (!luaL_getmetafield(M, -1, "__index") ||
+            (lua_type (M, -1) != LUA_TUSERDATA &&
+             lua_type (M, -1) != LUA_TTABLE)) {
             lua_settop(M, h);
             return NULL;
         }
 
-        /* Make some notes about the value we're completing.  We'll
-         * make use of them later on. */
+        lua_getglobal(M, "next");
+        lua_insert(M, -2);
+        lua_pushnil(M);
+    } else {
+        /* Call the standard pairs function. */
 
-        type = lua_type (M, -1);
-        suppress = (type == LUA_TTABLE || type == LUA_TUSERDATA ||
-                   type == LUA_TFUNCTION);
+        lua_getglobal (M, "pairs");
+        lua_pushvalue (M, -2);
 
-        keytype = LUA_TNIL;
-        if (type == LUA_TTABLE) {
-            lua_pushnil(M);
-            if (lua_next(M, -2)) {
-                keytype = lua_type (M, -2);
-                lua_pop (M, 2);
-            } else {
-                /* There are no keys in the table so we won't want to
-                 * index it.  Add a space. */
+        if(lua_type (M, -2) != LUA_TFUNCTION ||
+           lua_pcall (M, 1, 3, 0)) {
 
-                suppress = 0;
-            }
+            lua_settop(M, h);
+            return NULL;
         }
+    }
 
-        /* Pop the value, keep the key. */
+    /* Iterate the table/userdata and collect the keys, into the
+     * least recently built index. */
 
+    K = &indices[next_index];
+    next_index = (next_index + 1) % KEY_INDICES;
+    drop_index (K);
+
+    while (lua_pushvalue(M, -3), lua_insert (M, -3),
+           lua_pushvalue(M, -2), lua_insert (M, -4),
+           lua_pcall (M, 2, 2, 0) == 0 && !lua_isnil(M, -2)) {
+        add_key (K);
         lua_pop (M, 1);
+    }
 
-        /* We're mainly interested in strings at this point but if
-         * we're completing for the table[key] syntax we consider
-         * numeric keys too. */
+    lua_settop(M, h);
 
-        if (lua_type (M, -1) == LUA_TSTRING ||
-            (oper == '[' && lua_type (M, -1) == LUA_TNUMBER)) {
-            if (oper == '[') {
-                if (lua_type (M, -1) == LUA_TNUMBER) {
-                    lua_Number n;
-                    int i;
+    if (K->length > 0) {
+        qsort (K->keys, K->length, sizeof (IndexedKey), compare_indexed_keys);
+    }
 
-                    n = lua_tonumber (M, -1);
-                    i = lua_tointeger (M, -1);
+    lua_pushvalue (M, -1);
+    K->reference = luaL_ref (M, LUA_REGISTRYINDEX);
+    K->table = lua_topointer (M, -1);
+    K->metatable = look_up_metatable;
 
-                    /* If this isn't an integer key, we may as well
-                     * forget about it. */
+    return K;
+}
 
-                    if ((lua_Number)i == n) {
-                        l = asprintf (&candidate, "%d]", i);
-                    } else {
-                        continue;
-                    }
-                } else {
-                    char q;
+static int find_first_key (KeyIndex *K, int number, const char *s, size_t n)
+{
+    int i, j;
 
-                    q = token[0];
-                    if (q != '"' && q != '\'') {
-                        q = '"';
-                    }
+    /* Find the first key of the given kind, not lower than s. */
 
-                    l = asprintf (&candidate, "%c%s%c]",
-                                  q, lua_tostring (M, -1), q);
-                }
-            } else {
-                candidate = strdup((char *)lua_tolstring (M, -1, &l));
+    for (i = 0, j = K->length ; i < j ; ) {
+        IndexedKey *k = &K->keys[(i + j) / 2];
+        int d;
+
+        if (k->number != number) {
+            d = k->number - number;
+        } else {
+            d = memcmp (k->key, s, k->length < n ? k->length : n);
+
+            if (d == 0 && k->length < n) {
+                d = -1;
             }
+        }
 
-            m = strlen(token);
+        if (d < 0) {
+            i = (i + j) / 2 + 1;
+        } else {
+            j = (i + j) / 2;
+        }
+    }
 
-            if (l >= m && !strncmp (token, candidate, m) &&
-                (oper != ':' || type == LUA_TFUNCTION)
-#ifdef HIDDEN_KEY_PREFIX
-                && strncmp(candidate, HIDDEN_KEY_PREFIX,
-                           sizeof(HIDDEN_KEY_PREFIX) - 1)
-#endif
-                ) {
-                char *match;
+    return i;
+}
 
-                /* If the candidate has been fully typed (or
-                 * previously completed) consider adding certain
-                 * helpful suffixes. */
-#ifndef ALWAYS_APPEND_SUFFIXES
-                if (l == m) {
-#endif
-                    if (type == LUA_TFUNCTION) {
-                        rl_completion_append_character = '('; suppress = 0;
-                    } else if (type == LUA_TTABLE) {
-                        if (keytype == LUA_TSTRING) {
-                            rl_completion_append_character  = '.'; suppress = 0;
-                        } else if (keytype != LUA_TNIL) {
-                            rl_completion_append_character  = '['; suppress = 0;
-                        }
-                    }
-#ifndef ALWAYS_APPEND_SUFFIXES
-                };
-#endif
+/* The value to complete keys in is found by resolving the text
+ * before the key, such as a.b in a.b.c.  This is done natively for
+ * plain paths of names, and string or integer keys in brackets.  Keys
+ * are looked up directly, following __index metamethods only when
+ * they're tables, so that completion has no side effects, unless
+ * CALL_INDEX_METAMETHODS is defined.  Anything more complex is
+ * evaluated as an expression instead.  The last resolved path is
+ * kept, along with its value, until the keys might have changed. */
 
-                if (token > text) {
-                    /* Were not completing a global variable.  Put the
-                     * completed string together out of the table and
-                     * the key. */
+#define INDEX_CHAIN_MAX 100
 
-                    match = (char *)malloc ((token - text) + l + 1);
-                    strncpy (match, text, token - text);
-                    strcpy (match + (token - text), candidate);
+static char *resolved_path;
+static size_t resolved_length;
+static int resolved_value = LUA_NOREF;
+static unsigned int resolved_generation;
 
-                    free(candidate);
-                } else {
-                    /* Return the whole candidate as is, to be freed
-                     * by Readline. */
+static int look_up (void)
+{
+    int i;
 
-                    match = candidate;
-                }
+    /* Replace the value and key on the top of the stack with the
+     * value the key maps to, or return zero if there's none. */
 
-                /* Suppress the newline when completing a table
-                 * or other potentially complex value. */
+    for (i = 0 ; i < INDEX_CHAIN_MAX ; i += 1) {
+        if (lua_istable (M, -2)) {
+            lua_pushvalue (M, -1);
+            lua_rawget (M, -3);
 
-                if (suppress) {
-                    rl_completion_suppress_append = 1;
-                }
+            if (!lua_isnil (M, -1)) {
+                lua_replace (M, -3);
+                lua_pop (M, 1);
 
-                return match;
-            } else {
-                free(candidate);
+                return 1;
             }
+
+            lua_pop (M, 1);
+        }
+
+        if (!luaL_getmetafield (M, -2, "__index")) {
+            return 0;
+        }
+
+        if (lua_istable (M, -1)) {
+            lua_replace (M, -3);
+            continue;
         }
+
+#ifdef CALL_INDEX_METAMETHODS
+        if (lua_isfunction (M, -1)) {
+            lua_insert (M, -3);
+
+            return (lua_pcall (M, 2, 1, 0) == LUA_OK && !lua_isnil (M, -1));
+        }
+#endif
+
+        return 0;
     }
 
-    lua_settop(M, h);
-    return NULL;
+    return 0;
 }
-#endif
 
-#ifdef COMPLETE_MODULES
-static char *module_completions (const char *text, int state)
+static int resolve_path (const char *s, size_t n)
 {
-    char *match = NULL;
-    static int h;
+    const char *c, *b, *e;
 
-    if (state == 0) {
-        glob_t vector;
-        const char *b, *d, *q, *s, *t, *strings[3];
-        int i, n = 0, ondot, hasdot, quoted;
+    /* Push the value of the path and return 1, return 0 if the text
+     * isn't a plain path, or -1 if it can't be resolved. */
 
-        hasdot = strchr(text, '.') != NULL;
-        ondot = text[0] != '\0' && text[strlen(text) - 1] == '.';
-        quoted = text[0] == '\'' || text[0] == '"';
+    lua_pushglobaltable (M);
 
-#ifdef NO_MODULE_LOAD
-        if(!quoted) {
-            return NULL;
-        }
-#endif
+    for (c = s, e = s + n ; c < e ; ) {
+        if (c == s || *c == '.') {
+            /* A name. */
 
-        lua_newtable(M);
-        h = lua_gettop(M);
+            if (c > s) {
+                c += 1;
+            }
 
-        /* Try to load the input as a module. */
+            for (b = c ; c < e && (isalnum ((unsigned char)*c) || *c == '_') ; c += 1);
 
-        lua_getglobal(M, "require");
+            if (c == b || isdigit ((unsigned char)*b)) {
+                return 0;
+            }
 
-        if (!lua_isfunction (M, -1)) {
-            lua_settop(M, h - 1);
-            return NULL;
-        }
+            lua_pushlstring (M, b, c - b);
+        } else if (*c == '[' && c + 1 < e && (c[1] == '"' || c[1] == '\'')) {
+            /* A string key, without escapes. */
 
-        lua_pushliteral(M, "package");
+            for (b = c + 2 ; b < e && *b != c[1] && *b != '\\' ; b += 1);
 
-        if(lua_pcall(M, 1, 1, 0) != LUA_OK) {
-            lua_settop(M, h - 1);
-            return NULL;
-        }
+            if (b + 1 >= e || *b != c[1] || b[1] != ']') {
+                return 0;
+            }
 
-        if (!ondot && !quoted && text[0] != '\0') {
-            lua_getfield(M, -1, "loaded");
-            lua_pushstring(M, text);
-            lua_gettable(M, -2);
+            lua_pushlstring (M, c + 2, b - c - 2);
+            c = b + 2;
+        } else if (*c == '[') {
+            /* An integer key. */
 
-            /* If it's not an already loaded module, check whether the
-             * input is an available module by searching for it and/or
-             * trying to load it. */
+            b = c + 1;
+            c = *b == '-' ? b + 1 : b;
 
-            if (!lua_toboolean(M, -1)) {
-                int load = 1;
+            for (; c < e && isdigit ((unsigned char)*c) ; c += 1);
 
-                lua_pop(M, 2);
+            if (c >= e || *c != ']' || !isdigit ((unsigned char)c[-1])) {
+                return 0;
+            }
 
-#ifdef CONFIRM_MODULE_LOAD
-                /* Look for the module as require would and ask the
-                 * user whether it should be loaded or not. */
+            lua_pushinteger (M, strtol (b, NULL, 10));
+            c += 1;
+        } else {
+            return 0;
+        }
 
-#if LUA_VERSION_NUM == 501
-                lua_getfield(M, -1, "loaders");
-#else
-                lua_getfield(M, -1, "searchers");
-#endif
-                lua_pushnil(M);
+        if (!look_up ()) {
+            return -1;
+        }
+    }
 
-                while((load = lua_next(M, -2))) {
-                    lua_pushstring(M, text);
-                    lua_call(M, 1, 1);
+    return 1;
+}
 
-                    if (lua_isfunction(M, -1)) {
-                        char c;
+static int resolve (const char *s, size_t n)
+{
+    int h, status;
 
-                        print_output ("\nLoad module '%s' (y or n)", text);
+    h = lua_gettop(M);
 
-                        while ((c = tolower(rl_read_key())) != 'y' && c != 'n');
+    /* Reuse the last resolved path, if possible. */
 
-                        if (c == 'y') {
-                            lua_pop(M, 3);
-                            break;
-                        } else {
-                            print_output ("\n");
-                            rl_on_new_line ();
+    if (resolved_generation != generation) {
+        luaL_unref (M, LUA_REGISTRYINDEX, resolved_value);
+        resolved_value = LUA_NOREF;
+        resolved_generation = generation;
+    } else if (resolved_value != LUA_NOREF && n == resolved_length &&
+               !memcmp (s, resolved_path, n)) {
+        lua_rawgeti (M, LUA_REGISTRYINDEX, resolved_value);
 
-                            /* If it was found but not loaded, return
-                             * the module name as a match to avoid
-                             * asking the user again if the tab key
-                             * is pressed repeatedly. */
+        return 1;
+    }
 
-                            lua_settop(M, h);
-                            return strdup(text);
-                        }
-                    }
+    if ((status = resolve_path (s, n)) == 0) {
+        lua_settop(M, h);
 
-                    lua_pop(M, 1);
-                }
-#endif
+        /* It's not a plain path, so evaluate it. */
 
-                /* Load the model if needed. */
+        lua_pushliteral (M, "return ");
+        lua_pushlstring (M, s, n);
+        lua_concat (M, 2);
 
-                if (load) {
-                    lua_pushfstring (M, "%s=require(\"%s\")", text, text);
+        status = !(luaL_loadstring (M, lua_tostring (M, -1)) ||
+                   lua_pcall (M, 0, 1, 0));
+    }
 
-                    if (luaL_loadstring (M, lua_tostring (M, -1)) == LUA_OK &&
-                        lua_pcall (M, 0, 0, 0) == LUA_OK) {
-#ifdef CONFIRM_MODULE_LOAD
-                        print_output (" ...loaded\n");
-#else
-                        print_output ("\nLoaded module '%s'.\n", text);
-#endif
+    if (status <= 0 ||
+        (lua_type (M, -1) != LUA_TUSERDATA &&
+         lua_type (M, -1) != LUA_TTABLE)) {
+        lua_settop(M, h);
+        return 0;
+    }
 
-                        rl_on_new_line ();
+    if (lua_gettop(M) > h + 1) {
+        lua_replace(M, h + 1);
+        lua_settop(M, h + 1);
+    }
 
-                        lua_settop(M, h - 1);
-                        return NULL;
-                    }
-                }
-            } else {
-                lua_getglobal(M, text);
+    /* Remember it for the next time. */
 
-                if (lua_isnil(M, -1)) {
-#ifdef CONFIRM_MODULE_LOAD
-                    char c;
+    luaL_unref (M, LUA_REGISTRYINDEX, resolved_value);
+    lua_pushvalue (M, -1);
+    resolved_value = luaL_ref (M, LUA_REGISTRYINDEX);
 
-                    print_output ("\nGlobalize module '%s' (y or n)", text);
+    free (resolved_path);
+    resolved_path = (char *)malloc (n);
+    memcpy (resolved_path, s, n);
+    resolved_length = n;
 
-                    while ((c = tolower(rl_read_key())) != 'y' && c != 'n');
+    return 1;
+}
 
-                    if (c == 'y') {
-#endif
-                        lua_pop(M, 1);
-                        lua_setglobal(M, text);
+static char *table_key_completions (const char *text, int state)
+{
+    static const char *c, *token, *prefix;
+    static KeyIndex *K;
+    static size_t n;
+    static char oper;
+    static int i, number, all;
 
-#ifdef CONFIRM_MODULE_LOAD
-                        print_output (" ...done\n");
-                        rl_on_new_line ();
-                    } else {
-                        print_output ("\n");
-                        rl_on_new_line ();
+    if (state == 0) {
+        int h;
 
-                        /* If user opted against globalization, return
-                         * the module name as a match to avoid asking
-                         * the user again if the tab key is pressed
-                         * repeatedly. */
+        h = lua_gettop(M);
 
-                        lua_settop(M, h);
-                        return strdup(text);
-                    }
-#else
-                    print_output ("\nGlobalized module '%s'.\n", text);
-                    rl_on_new_line ();
-#endif
-                }
+        /* Scan to the beginning of the to-be-completed token. */
 
-                lua_settop(M, h - 1);
+        for (c = text + strlen (text) - 1;
+             c >= text && *c != '.' && *c != ':' && *c != '[';
+             c -= 1);
+
+        if (c > text) {
+            oper = *c;
+            token = c + 1;
+
+            /* Get the iterable value, the keys of which we wish to
+             * complete. */
+
+            if (!resolve (text, token - text - 1)) {
                 return NULL;
             }
+        } else {
+            oper = 0;
+            token = text;
 
-            /* Clean up but leave the package.table on the stack. */
-
-            lua_settop(M, h + 1);
+            lua_pushglobaltable(M);
         }
 
-        /* Look for matches in package.preload. */
+        K = find_index ();
+        lua_settop(M, h);
 
-        lua_getfield(M, -1, "preload");
+        if (!K) {
+            return NULL;
+        }
 
-        lua_pushnil(M);
-        while(lua_next(M, -2)) {
-            lua_pop(M, 1);
+        /* Decide which keys can match.  When completing for the
+         * table[key] syntax, quoted tokens can only match string keys,
+         * unquoted ones only integer keys, and empty ones any key. */
 
-            if (lua_type(M, -1) == LUA_TSTRING &&
-                    !strncmp(text + quoted, lua_tostring(M, -1),
-                             strlen(text + quoted))) {
+        prefix = token;
+        number = 0;
+        all = 0;
 
-                lua_pushstring(M, text);
-                lua_rawseti (M, h, (n += 1));
+        if (oper == '[') {
+            if (token[0] == '"' || token[0] == '\'') {
+                prefix = token + 1;
+            } else if (token[0] != '\0') {
+                number = 1;
+            } else {
+                all = 1;
             }
         }
 
-        lua_pop(M, 1);
+        n = strlen (prefix);
+        i = all ? 0 : find_first_key (K, number, prefix, n);
+    }
 
-        /* Get the configuration (directory, path separators, module
-         * name wildcard). */
+    /* Generate matches, out of the index. */
 
-        lua_getfield(M, -1, "config");
-        for (s = (char *)lua_tostring(M, -1), i = 0;
-             i < 3;
-             s = t + 1, i += 1) {
+    for (; i < K->length ; i += 1) {
+        IndexedKey *k = &K->keys[i];
+        char *candidate, *match;
+        size_t l;
+        int suppress;
 
-            t = strchr(s, '\n');
-            lua_pushlstring(M, s, t - s);
-            strings[i] = lua_tostring(M, -1);
+        if (!all && (k->number != number || k->length < n ||
+                     memcmp (k->key, prefix, n))) {
+            break;
         }
 
-        lua_remove(M, -4);
+        if ((oper == ':' && k->type != LUA_TFUNCTION)
+#ifdef HIDDEN_KEY_PREFIX
+            || !strncmp(k->key, HIDDEN_KEY_PREFIX,
+                        sizeof(HIDDEN_KEY_PREFIX) - 1)
+#endif
+            ) {
+            continue;
+        }
 
-        /* Get the path and cpath */
+        /* Make the candidate.  For the table[key] syntax, strings
+         * are quoted as in the token, or in double quotes. */
 
-        lua_getfield(M, -4, "path");
-        lua_pushstring(M, strings[1]);
-        lua_getfield(M, -6, "cpath");
-        lua_pushstring(M, strings[1]);
-        lua_concat(M, 4);
+        if (oper == '[') {
+            if (k->number) {
+                l = asprintf (&candidate, "%s]", k->key);
+            } else {
+                char q;
 
-        /* Synthesize the pattern. */
+                q = token[0];
+                if (q != '"' && q != '\'') {
+                    q = '"';
+                }
 
-        if (hasdot) {
-            luaL_gsub(M, text + quoted, ".", strings[0]);
+                l = asprintf (&candidate, "%c%s%c]", q, k->key, q);
+            }
         } else {
-            lua_pushstring(M, text + quoted);
+            candidate = strdup(k->key);
+            l = k->length;
         }
 
-        lua_pushliteral(M, "*");
-        lua_concat(M, 2);
+        i += 1;
 
-        for (b = d = lua_tostring(M, -2) ; d ; b = d + 1)  {
-            size_t i;
+        /* Make some notes about the value we're completing. */
 
-            d = strstr(b, strings[1]);
-            q = strstr(b, strings[2]);
+        suppress = (k->type == LUA_TTABLE || k->type == LUA_TUSERDATA ||
+                    k->type == LUA_TFUNCTION);
 
-            if (!q || q > d) {
-                continue;
-            }
+        if (k->type == LUA_TTABLE && k->keytype == LUA_TNIL) {
+            /* There are no keys in the table so we won't want to
+             * index it.  Add a space. */
 
-            lua_pushlstring(M, b, d - b);
-            luaL_gsub(M, lua_tostring(M, -1), strings[2],
-                      lua_tostring(M, -2));
+            suppress = 0;
+        }
 
-            glob(lua_tostring(M, -1), 0, NULL, &vector);
+        /* If the candidate has been fully typed (or previously
+         * completed) consider adding certain helpful suffixes. */
+#ifndef ALWAYS_APPEND_SUFFIXES
+        if (l == strlen (token)) {
+#endif
+            if (k->type == LUA_TFUNCTION) {
+                rl_completion_append_character = '('; suppress = 0;
+            } else if (k->type == LUA_TTABLE) {
+                if (k->keytype == LUA_TSTRING) {
+                    rl_completion_append_character  = '.'; suppress = 0;
+                } else if (k->keytype != LUA_TNIL) {
+                    rl_completion_append_character  = '['; suppress = 0;
+                }
+            }
+#ifndef ALWAYS_APPEND_SUFFIXES
+        };
+#endif
 
-            lua_pop(M, 2);
+        if (token > text) {
+            /* Were not completing a global variable.  Put the
+             * completed string together out of the table and
+             * the key. */
 
-            for (i = 0 ; i < vector.gl_pathc ; i += 1) {
-                char *p = vector.gl_pathv[i];
+            match = (char *)malloc ((token - text) + l + 1);
+            strncpy (match, text, token - text);
+            strcpy (match + (token - text), candidate);
 
-                if (quoted) {
-                    lua_pushlstring(M, text, 1);
-                }
+            free(candidate);
+        } else {
+            /* Return the whole candidate as is, to be freed
+             * by Readline. */
 
-                lua_pushlstring(M, p + (q - b), strlen(p) - (d - b) + 1);
+            match = candidate;
+        }
 
-                if (hasdot) {
-                    luaL_gsub(M, lua_tostring(M, -1), strings[0], ".");
-                    lua_replace(M, -2);
-                }
+        /* Suppress the newline when completing a table
+         * or other potentially complex value. */
 
-                {
-                    const char *s;
-                    size_t l;
+        if (suppress) {
+            rl_completion_suppress_append = 1;
+        }
 
-                    s = lua_tolstring(M, -1, &l);
+        return match;
+    }
 
-                    /* Suppress submodules named init. */
+    return NULL;
+}
+#endif
 
-                    if (l < sizeof("init") - 1 ||
-                        strcmp(s + l - sizeof("init") + 1, "init")) {
+#ifdef COMPLETE_MODULES
 
-                        if (quoted) {
-                            lua_pushlstring(M, text, 1);
+/* Module names are completed by looking for files that match the
+ * templates in package.path and package.cpath.  The listings of the
+ * directories involved are kept, sorted so that the files starting
+ * with some prefix can be found by binary search, and only read
+ * again when a directory's modification time changes, which is
+ * checked at most once per line.  If an index file has been set, the
+ * listings are also kept there, across sessions.  The file is
+ * mapped into memory and the listings loaded from it refer to it
+ * directly, so that loading it takes no copying.  It consists of the
+ * MODULE_INDEX_MAGIC line, followed by the modification time, path,
+ * entry count and entries of each listing, as NUL-terminated
+ * strings. */
+
+#define MODULE_INDEX_MAGIC "luaprompt module index 1\n"
+
+typedef struct {
+    char *path, *names;
+    const char **entries;
+    long long mtime;
+    int length;
+    unsigned int checked;
+} Listing;
+
+static Listing **listings;
+static int nlistings, maxlistings, listings_loaded, listings_dirty;
+
+static Listing *find_listing (const char *path)
+{
+    Listing *D;
+    int i, j, k;
 
-                            lua_concat(M, 3);
-                        }
+    /* Look the listing up by binary search, as the listings are
+     * kept sorted by path, adding an empty one if needed. */
 
-                        lua_rawseti(M, h, (n += 1));
-                    } else {
-                        lua_pop(M, 1 + quoted);
-                    }
-                }
-            }
+    for (i = 0, j = nlistings ; i < j ; ) {
+        k = strcmp (listings[(i + j) / 2]->path, path);
 
-            globfree(&vector);
+        if (k == 0) {
+            return listings[(i + j) / 2];
+        } else if (k < 0) {
+            i = (i + j) / 2 + 1;
+        } else {
+            j = (i + j) / 2;
         }
+    }
 
-        lua_pop(M, 6);
+    if (nlistings == maxlistings) {
+        maxlistings = maxlistings > 0 ? 2 * maxlistings : 64;
+        listings = (Listing **)realloc (listings,
+                                        maxlistings * sizeof (Listing *));
     }
 
-    /* Return the next match from the table of matches. */
+    memmove (listings + i + 1, listings + i,
+             (nlistings - i) * sizeof (Listing *));
+    nlistings += 1;
 
-    lua_pushnil(M);
-    if (lua_next(M, -2)) {
-        match = strdup(lua_tostring(M, -1));
+    D = listings[i] = (Listing *)calloc (1, sizeof (Listing));
+    D->path = strdup (path);
+    D->checked = generation - 1;
 
-        rl_completion_suppress_append = !(match[0] == '"' || match[0] == '\'');
+    return D;
+}
 
-        /* Pop the match. */
+static int compare_names (const void *a, const void *b)
+{
+    return strcmp (*(const char **)a, *(const char **)b);
+}
 
-        lua_pushnil(M);
-        lua_rawseti(M, -4, lua_tointeger(M, -3));
+static void read_listing (Listing *D)
+{
+    struct dirent *e;
+    size_t l, n, size;
+    DIR *dir;
+    int i;
 
-        /* Pop key/value. */
+    /* Read the directory's entries into a single block, then sort
+     * pointers to them. */
 
-        lua_pop(M, 2);
-    } else {
-        /* Pop the empty table. */
+    free (D->names);
+    free (D->entries);
+    D->names = NULL;
+    D->entries = NULL;
+    D->length = 0;
 
-        lua_pop(M, 1);
+    if (!(dir = opendir (D->path))) {
+        return;
     }
 
-    return match;
+    for (n = 0, size = 0 ; (e = readdir (dir)) ; ) {
+        if (!strcmp (e->d_name, ".") || !strcmp (e->d_name, "..")) {
+            continue;
+        }
+
+        l = strlen (e->d_name) + 1;
+
+        if (n + l > size) {
+            size = size > 0 ? 2 * size + l : 1024 + l;
+            D->names = (char *)realloc (D->names, size);
+        }
+
+        memcpy (D->names + n, e->d_name, l);
+        n += l;
+        D->length += 1;
+    }
+
+    closedir (dir);
+
+    D->entries = (const char **)malloc ((D->length + 1) * sizeof (char *));
+
+    for (i = 0, l = 0 ; i < D->length ; i += 1) {
+        D->entries[i] = D->names + l;
+        l += strlen (D->names + l) + 1;
+    }
+
+    qsort (D->entries, D->length, sizeof (char *), compare_names);
 }
-#endif
 
-static char *generator (const char *text, int state)
+static void load_index (void)
 {
-    static int which;
-    char *match = NULL;
+    const char *c, *e;
+    struct stat s;
+    void *mapping;
+    int fd;
 
-    if (state == 0) {
-        which = 0;
+    /* Load the listings from the index file, at most once.  Anything
+     * that doesn't look right makes us ignore the rest of it. */
+
+    listings_loaded = 1;
+
+    if (!indexfile || (fd = open (indexfile, O_RDONLY)) < 0) {
+        return;
     }
 
-    /* Try to complete a keyword. */
+    if (fstat (fd, &s) < 0 || (size_t)s.st_size <= sizeof (MODULE_INDEX_MAGIC) ||
+        (mapping = mmap (NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+        MAP_FAILED) {
+        close (fd);
+        return;
+    }
 
-    if (which == 0) {
-#ifdef COMPLETE_KEYWORDS
-        if ((match = keyword_completions (text, state))) {
-            return match;
-        }
-#endif
-        which += 1;
-        state = 0;
+    close (fd);
+
+    c = (const char *)mapping;
+    e = c + s.st_size;
+
+    if (memcmp (c, MODULE_INDEX_MAGIC, sizeof (MODULE_INDEX_MAGIC) - 1) ||
+        e[-1] != '\0') {
+        munmap (mapping, s.st_size);
+        return;
     }
 
-    /* Try to complete a module name. */
+    /* The mapping is kept for the rest of the session, as the
+     * entries refer to it. */
 
-    if (which == 1) {
-#ifdef COMPLETE_MODULES
-        if ((match = module_completions (text, state))) {
-            return match;
+    for (c += sizeof (MODULE_INDEX_MAGIC) - 1 ; c < e ; ) {
+        const char *t, *path;
+        long long mtime;
+        Listing *D;
+        int i, n;
+
+        mtime = strtoll (c, NULL, 10);
+        c += strlen (c) + 1;
+
+        if (c >= e) {
+            break;
         }
-#endif
-        which += 1;
-        state = 0;
-    }
 
-    /* Try to complete a table access. */
+        path = c;
+        c += strlen (c) + 1;
 
-    if (which == 2) {
-#ifdef COMPLETE_TABLE_KEYS
-        look_up_metatable = 0;
-        if ((match = table_key_completions (text, state))) {
-            return match;
+        if (c >= e) {
+            break;
         }
-#endif
-        which += 1;
-        state = 0;
-    }
 
-    /* Try to complete a metatable access. */
+        n = atoi (c);
+        c += strlen (c) + 1;
 
-    if (which == 3) {
-#ifdef COMPLETE_METATABLE_KEYS
-        look_up_metatable = 1;
-        if ((match = table_key_completions (text, state))) {
-            return match;
+        for (i = 0, t = c ; i < n && t < e ; i += 1, t += strlen (t) + 1);
+
+        if (n < 0 || i < n) {
+            break;
         }
-#endif
-        which += 1;
-        state = 0;
-    }
 
-#ifdef COMPLETE_FILE_NAMES
-    /* Try to complete a file name. */
+        D = find_listing (path);
+        D->mtime = mtime;
+        D->length = n;
+        D->entries = (const char **)realloc (D->entries,
+                                             (n + 1) * sizeof (char *));
 
-    if (which == 4) {
-        if (text[0] == '\'' || text[0] == '"') {
-            match = rl_filename_completion_function (text + 1, state);
+        for (i = 0 ; i < n ; i += 1, c += strlen (c) + 1) {
+            D->entries[i] = c;
+        }
+    }
+}
 
-            if (match) {
-                struct stat s;
-                int n;
+static void save_index (void)
+{
+    FILE *f;
+    char *t;
+    int i, j;
 
-                n = strlen (match);
-                stat(match, &s);
+    /* Write the listings to a temporary file, then move it into
+     * place, so that other sessions never see it half-written. */
 
-                /* If a match was produced, add the quote
-                 * characters. */
+    if (!indexfile || !listings_dirty) {
+        return;
+    }
 
-                match = (char *)realloc (match, n + 3);
-                memmove (match + 1, match, n);
-                match[0] = text[0];
+    listings_dirty = 0;
+    t = (char *)malloc (strlen (indexfile) + sizeof (".tmp"));
+    sprintf (t, "%s.tmp", indexfile);
 
-                /* If the file's a directory, add a trailing backslash
-                 * and suppress the space, otherwise add the closing
-                 * quote. */
+    if ((f = fopen (t, "w"))) {
+        fputs (MODULE_INDEX_MAGIC, f);
 
-                if (S_ISDIR(s.st_mode)) {
-                    match[n + 1] = '/';
+        for (i = 0 ; i < nlistings ; i += 1) {
+            Listing *D = listings[i];
 
-                    rl_completion_suppress_append = 1;
-                } else {
-                    match[n + 1] = text[0];
-                }
+            if (D->mtime == 0) {
+                continue;
+            }
 
-                match[n + 2] = '\0';
+            fprintf (f, "%lld%c%s%c%d%c",
+                     D->mtime, '\0', D->path, '\0', D->length, '\0');
+
+            for (j = 0 ; j < D->length ; j += 1) {
+                fwrite (D->entries[j], 1, strlen (D->entries[j]) + 1, f);
             }
         }
+
+        if (fclose (f) == 0) {
+            rename (t, indexfile);
+        } else {
+            unlink (t);
+        }
     }
-#endif
 
-    return match;
+    free (t);
 }
-#endif
 
-static void finish ()
+#ifdef DISCOVER_MODULES
+
+/* Module directories can be listed in advance, on a thread started
+ * when the prompt is entered.  The thread is handed the directories
+ * named in the templates, lists them, as well as their
+ * subdirectories, and hands each listing back through the
+ * discovered array.  It never touches the Lua state, or the
+ * listings used for completion, which are only updated from the
+ * discovered listings, when completing. */
+
+static pthread_mutex_t discovery_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t discovery_thread;
+static Listing **discovered;
+static int ndiscovered, maxdiscovered, discovering, discovered_all;
+
+static void discover_directory (const char *path, int depth)
 {
-#ifdef HAVE_READLINE_HISTORY
-    /* Save the command history on exit. */
+    struct stat s;
+    Listing *D;
+    char **subdirectories = NULL;
+    int i, n = 0;
 
-    if (logfile) {
-        write_history (logfile);
+    if (stat (path, &s) < 0 || !S_ISDIR (s.st_mode)) {
+        return;
     }
-#endif
+
+    D = (Listing *)calloc (1, sizeof (Listing));
+    D->path = strdup (path);
+    D->mtime = (long long)s.st_mtime;
+    read_listing (D);
+
+    /* Note the subdirectories, before the listing is handed over. */
+
+    if (depth > 0) {
+        subdirectories = (char **)malloc ((D->length + 1) * sizeof (char *));
+
+        for (i = 0 ; i < D->length ; i += 1) {
+            if (D->entries[i][0] != '.') {
+                subdirectories[n] = (char *)malloc (strlen (path) +
+                                                    strlen (D->entries[i]) + 2);
+                sprintf (subdirectories[n], "%s%s/", path, D->entries[i]);
+                n += 1;
+            }
+        }
+    }
+
+    pthread_mutex_lock (&discovery_lock);
+
+    if (ndiscovered == maxdiscovered) {
+        maxdiscovered = maxdiscovered > 0 ? 2 * maxdiscovered : 64;
+        discovered = (Listing **)realloc (discovered,
+                                          maxdiscovered * sizeof (Listing *));
+    }
+
+    discovered[ndiscovered] = D;
+    ndiscovered += 1;
+
+    pthread_mutex_unlock (&discovery_lock);
+
+    for (i = 0 ; i < n ; i += 1) {
+        discover_directory (subdirectories[i], depth - 1);
+        free (subdirectories[i]);
+    }
+
+    free (subdirectories);
 }
 
-static int traceback(lua_State *L)
+static void *discover (void *data)
 {
-    lua_Debug ar;
+    char **roots = (char **)data;
     int i;
 
-    if (lua_isnoneornil (L, 1) ||
-        (!lua_isstring (L, 1) &&
-         !luaL_callmeta(L, 1, "__tostring"))) {
-        lua_pushliteral(L, "(no error message)");
+    for (i = 0 ; roots[i] ; i += 1) {
+        discover_directory (roots[i], 1);
+        free (roots[i]);
     }
 
-    if (lua_gettop (L) > 1) {
-        lua_replace (L, 1);
-        lua_settop (L, 1);
-    }
+    free (roots);
 
-    /* Print the Lua stack. */
+    pthread_mutex_lock (&discovery_lock);
+    discovered_all = 1;
+    pthread_mutex_unlock (&discovery_lock);
 
-    lua_pushstring(L, "\n\nStack trace:\n");
+    return NULL;
+}
+
+static void collect_discoveries (void)
+{
+    Listing **L, *D;
+    int i, n, done;
+
+    /* Take the listings discovered so far, holding the lock only
+     * for as long as it takes to do that. */
+
+    pthread_mutex_lock (&discovery_lock);
+
+    L = discovered;
+    n = ndiscovered;
+    done = discovered_all;
+
+    discovered = NULL;
+    ndiscovered = maxdiscovered = 0;
+
+    pthread_mutex_unlock (&discovery_lock);
+
+    for (i = 0 ; i < n ; i += 1) {
+        D = find_listing (L[i]->path);
+
+        if (D->mtime != L[i]->mtime) {
+            listings_dirty = 1;
+        }
+
+        free (D->names);
+        free (D->entries);
+
+        D->names = L[i]->names;
+        D->entries = L[i]->entries;
+        D->length = L[i]->length;
+        D->mtime = L[i]->mtime;
+        D->checked = generation;
+
+        free (L[i]->path);
+        free (L[i]);
+    }
+
+    free (L);
+
+    if (done) {
+        pthread_join (discovery_thread, NULL);
+        discovering = 0;
+    }
+}
+#endif
+
+static Listing *get_listing (const char *path)
+{
+    struct stat s;
+    Listing *D;
+
+    /* Find the listing of a directory, making sure it's up to date,
+     * unless it's been checked since the last line was read. */
+
+    if (!listings_loaded) {
+        load_index ();
+    }
+
+#ifdef DISCOVER_MODULES
+    /* While discovery is under way, make do with whatever has been
+     * listed so far, rather than risk blocking on a slow
+     * directory. */
+
+    if (discovering) {
+        collect_discoveries ();
+
+        if (discovering) {
+            return find_listing (path);
+        }
+    }
+#endif
+
+    D = find_listing (path);
+
+    if (D->checked != generation) {
+        D->checked = generation;
+
+        if (stat (path, &s) < 0 || !S_ISDIR (s.st_mode)) {
+            if (D->mtime != 0) {
+                D->mtime = 0;
+                read_listing (D);
+                listings_dirty = 1;
+            }
+        } else if ((long long)s.st_mtime != D->mtime) {
+            D->mtime = (long long)s.st_mtime;
+            read_listing (D);
+            listings_dirty = 1;
+        }
+    }
+
+    return D;
+}
+
+static int find_entry (Listing *D, const char *s, size_t n)
+{
+    int i, j;
+
+    /* Find the first entry not lower than the first n bytes of s. */
+
+    for (i = 0, j = D->length ; i < j ; ) {
+        if (strncmp (D->entries[(i + j) / 2], s, n) < 0) {
+            i = (i + j) / 2 + 1;
+        } else {
+            j = (i + j) / 2;
+        }
+    }
+
+    return i;
+}
+
+static int has_entry (const char *path, const char *s)
+{
+    Listing *D;
+    int i;
+
+    D = get_listing (path);
+    i = find_entry (D, s, strlen (s) + 1);
+
+    return i < D->length && !strcmp (D->entries[i], s);
+}
+
+static int push_directory (const char *s, size_t n, char c)
+{
+    char *w, *t;
+    size_t i, j, l;
+
+    /* Push the first n bytes of path s, made absolute, with empty
+     * and "." components removed, so that each directory has a
+     * single listing. */
+
+    if (s[0] == c) {
+        w = strdup ("");
+    } else if (!(w = getcwd (NULL, 0))) {
+        return 0;
+    }
+
+    l = strlen (w);
+    t = (char *)malloc (l + n + 2);
+    memcpy (t, w, l);
+    free (w);
+
+    if (l == 0 || t[l - 1] != c) {
+        t[l++] = c;
+    }
+
+    for (i = 0 ; i < n ; i = j + 1) {
+        for (j = i ; j < n && s[j] != c ; j += 1);
+
+        if (j == i || (j == i + 1 && s[i] == '.')) {
+            continue;
+        }
+
+        memcpy (t + l, s + i, j - i + 1);
+        l += j - i + 1;
+    }
+
+    lua_pushlstring(M, t, l);
+    free (t);
+
+    return 1;
+}
+
+#ifdef DISCOVER_MODULES
+static void start_discovery (void)
+{
+    const char *b, *d, *q, *r, *s, *t, *strings[3];
+    char **roots = NULL;
+    int i, j, n = 0, h;
+
+    /* Collect the directories named in the templates, up to the
+     * wildcard, and start a thread to list them. */
+
+    h = lua_gettop(M);
+    lua_getglobal(M, "package");
+
+    if (!lua_istable(M, -1)) {
+        lua_settop(M, h);
+        return;
+    }
+
+    lua_getfield(M, -1, "config");
+
+    if (!lua_isstring(M, -1)) {
+        lua_settop(M, h);
+        return;
+    }
+
+    for (s = lua_tostring(M, -1), i = 0 ; i < 3 ; s = t + 1, i += 1) {
+        if (!(t = strchr(s, '\n'))) {
+            lua_settop(M, h);
+            return;
+        }
+
+        lua_pushlstring(M, s, t - s);
+        strings[i] = lua_tostring(M, -1);
+    }
+
+    lua_getfield(M, h + 1, "path");
+    lua_pushstring(M, strings[1]);
+    lua_getfield(M, h + 1, "cpath");
+    lua_pushstring(M, strings[1]);
+    lua_concat(M, 4);
+
+    for (b = d = lua_tostring(M, -1) ; d ; b = d + 1)  {
+        d = strstr(b, strings[1]);
+        q = strstr(b, strings[2]);
+
+        if (!q || q > d) {
+            continue;
+        }
+
+        for (r = q ; r > b && r[-1] != strings[0][0] ; r -= 1);
+
+        if (!push_directory (b, r - b, strings[0][0])) {
+            continue;
+        }
+
+        for (j = 0 ; j < n && strcmp (roots[j], lua_tostring(M, -1)) ; j += 1);
+
+        if (j == n) {
+            roots = (char **)realloc (roots, (n + 2) * sizeof (char *));
+            roots[n] = strdup (lua_tostring(M, -1));
+            n += 1;
+        }
+
+        lua_pop(M, 1);
+    }
+
+    lua_settop(M, h);
+
+    if (n == 0) {
+        return;
+    }
+
+    roots[n] = NULL;
+
+    if (pthread_create (&discovery_thread, NULL, discover, roots) == 0) {
+        discovering = 1;
+    } else {
+        for (i = 0 ; i < n ; i += 1) {
+            free (roots[i]);
+        }
+
+        free (roots);
+    }
+}
+#endif
+
+static int add_modules (int h, int n, const char *b, const char *q,
+                        const char *d, const char *path,
+                        const char *separator, const char *quote)
+{
+    const char *s, *r, *prefix, *entry;
+    size_t k, m, l, x;
+    Listing *D;
+    char c;
+    int i;
+
+    /* Add the modules matching the template from b to d, with the
+     * wildcard at q, and the path of the text to complete, to the
+     * table at h, which already holds n modules.  The template is
+     * filled in as far as the wildcard and split into the directory
+     * and the prefix of the files to look for in it. */
+
+    c = separator[0];
+
+    lua_pushlstring(M, b, q - b);
+    lua_pushstring(M, path);
+    lua_concat(M, 2);
+    s = lua_tolstring(M, -1, &l);
+
+    for (k = l ; k > 0 && s[k - 1] != c ; k -= 1);
+
+    prefix = s + k;
+
+    if (!push_directory (s, k, c)) {
+        lua_pop(M, 1);
+        return n;
+    }
+
+    /* Files must start with the prefix and end with the part of the
+     * template after the wildcard, up to a separator.  If there is
+     * such a separator, the rest of the template must exist in the
+     * file, now a directory.  Modules named init are left out, as
+     * they're loaded through their directory's name. */
+
+    D = get_listing (lua_tostring(M, -1));
+    m = strlen (prefix);
+
+    for (r = q + 1 ; r < d && *r != c ; r += 1);
+
+    for (i = find_entry (D, prefix, m) ;
+         i < D->length && !strncmp (D->entries[i], prefix, m) ;
+         i += 1) {
+        entry = D->entries[i];
+        x = strlen (entry);
+
+        if ((entry[0] == '.' && prefix[0] != '.') ||
+            x < m + (r - q - 1) ||
+            strncmp (entry + x - (r - q - 1), q + 1, r - q - 1)) {
+            continue;
+        }
+
+        if (r < d) {
+            const char *t;
+            int found;
+
+            /* Look the last component of the rest up in the listing
+             * of the directory containing it. */
+
+            for (t = d ; t[-1] != c ; t -= 1);
+
+            lua_pushfstring(M, "%s%s%c", lua_tostring(M, -1), entry, c);
+            lua_pushlstring(M, r + 1, t - r - 1);
+            lua_concat(M, 2);
+            lua_pushlstring(M, t, d - t);
+
+            found = has_entry (lua_tostring(M, -2), lua_tostring(M, -1));
+            lua_pop(M, 2);
+
+            if (!found) {
+                continue;
+            }
+        }
+
+        /* Put together the module name, out of the part of the path
+         * beyond the template's directory, and the entry, less the
+         * template's suffix. */
+
+        lua_pushstring(M, quote);
+
+        if (k > (size_t)(q - b)) {
+            lua_pushlstring(M, s + (q - b), k - (q - b));
+            lua_pushlstring(M, entry, x - (r - q - 1));
+            lua_concat(M, 2);
+
+            luaL_gsub(M, lua_tostring(M, -1), separator, ".");
+            lua_replace(M, -2);
+        } else {
+            size_t y = (q - b) - k;
+
+            lua_pushlstring(M, entry + y, x - y - (r - q - 1));
+        }
+
+        {
+            const char *name;
+            size_t z;
+
+            name = lua_tolstring(M, -1, &z);
+
+            if (z >= sizeof("init") - 1 &&
+                !strcmp(name + z - sizeof("init") + 1, "init")) {
+                lua_pop(M, 2);
+                continue;
+            }
+        }
+
+        lua_pushstring(M, quote);
+        lua_concat(M, 3);
+        lua_rawseti(M, h, (n += 1));
+    }
+
+    lua_pop(M, 2);
+
+    return n;
+}
+
+static char *module_completions (const char *text, int state)
+{
+    char *match = NULL;
+    static int h, i, n;
+
+    if (state == 0) {
+        const char *b, *d, *q, *s, *t, *strings[3];
+        char quote[2] = {'\0', '\0'};
+        int ondot, hasdot, quoted;
+
+        hasdot = strchr(text, '.') != NULL;
+        ondot = text[0] != '\0' && text[strlen(text) - 1] == '.';
+        quoted = text[0] == '\'' || text[0] == '"';
+
+#ifdef NO_MODULE_LOAD
+        if(!quoted) {
+            return NULL;
+        }
+#endif
+
+        lua_newtable(M);
+        h = lua_gettop(M);
+        n = 0;
+
+        /* Try to load the input as a module. */
+
+        lua_getglobal(M, "require");
+
+        if (!lua_isfunction (M, -1)) {
+            lua_settop(M, h - 1);
+            return NULL;
+        }
+
+        lua_pushliteral(M, "package");
+
+        if(lua_pcall(M, 1, 1, 0) != LUA_OK) {
+            lua_settop(M, h - 1);
+            return NULL;
+        }
+
+        if (!ondot && !quoted && text[0] != '\0') {
+            lua_getfield(M, -1, "loaded");
+            lua_pushstring(M, text);
+            lua_gettable(M, -2);
+
+            /* If it's not an already loaded module, check whether the
+             * input is an available module by searching for it and/or
+             * trying to load it. */
+
+            if (!lua_toboolean(M, -1)) {
+                int load = 1;
+
+                lua_pop(M, 2);
+
+#ifdef CONFIRM_MODULE_LOAD
+                /* Look for the module as require would and ask the
+                 * user whether it should be loaded or not. */
 
-    for (i = 0 ; lua_getstack (L, i, &ar) ; i += 1) {
 #if LUA_VERSION_NUM == 501
-        lua_getinfo(M, "Snl", &ar);
+                lua_getfield(M, -1, "loaders");
 #else
-        lua_getinfo(M, "Snlt", &ar);
+                lua_getfield(M, -1, "searchers");
+#endif
+                lua_pushnil(M);
+
+                while((load = lua_next(M, -2))) {
+                    lua_pushstring(M, text);
+                    lua_call(M, 1, 1);
+
+                    if (lua_isfunction(M, -1)) {
+                        char c;
+
+                        print_output ("\nLoad module '%s' (y or n)", text);
+
+                        while ((c = tolower(rl_read_key())) != 'y' && c != 'n');
+
+                        if (c == 'y') {
+                            lua_pop(M, 3);
+                            break;
+                        } else {
+                            print_output ("\n");
+                            rl_on_new_line ();
+
+                            /* If it was found but not loaded, return
+                             * the module name as a match to avoid
+                             * asking the user again if the tab key
+                             * is pressed repeatedly. */
+
+                            lua_settop(M, h);
+                            return strdup(text);
+                        }
+                    }
+
+                    lua_pop(M, 1);
+                }
+#endif
+
+                /* Load the model if needed. */
+
+                if (load) {
+                    lua_pushfstring (M, "%s=require(\"%s\")", text, text);
+
+                    if (luaL_loadstring (M, lua_tostring (M, -1)) == LUA_OK &&
+                        lua_pcall (M, 0, 0, 0) == LUA_OK) {
+                        generation += 1;
+
+#ifdef CONFIRM_MODULE_LOAD
+                        print_output (" ...loaded\n");
+#else
+                        print_output ("\nLoaded module '%s'.\n", text);
+#endif
+
+                        rl_on_new_line ();
+
+                        lua_settop(M, h - 1);
+                        return NULL;
+                    }
+                }
+            } else {
+                lua_getglobal(M, text);
+
+                if (lua_isnil(M, -1)) {
+#ifdef CONFIRM_MODULE_LOAD
+                    char c;
+
+                    print_output ("\nGlobalize module '%s' (y or n)", text);
+
+                    while ((c = tolower(rl_read_key())) != 'y' && c != 'n');
+
+                    if (c == 'y') {
+#endif
+                        lua_pop(M, 1);
+                        lua_setglobal(M, text);
+                        generation += 1;
+
+#ifdef CONFIRM_MODULE_LOAD
+                        print_output (" ...done\n");
+                        rl_on_new_line ();
+                    } else {
+                        print_output ("\n");
+                        rl_on_new_line ();
+
+                        /* If user opted against globalization, return
+                         * the module name as a match to avoid asking
+                         * the user again if the tab key is pressed
+                         * repeatedly. */
+
+                        lua_settop(M, h);
+                        return strdup(text);
+                    }
+#else
+                    print_output ("\nGlobalized module '%s'.\n", text);
+                    rl_on_new_line ();
+#endif
+                }
+
+                lua_settop(M, h - 1);
+                return NULL;
+            }
+
+            /* Clean up but leave the package.table on the stack. */
+
+            lua_settop(M, h + 1);
+        }
+
+        /* Look for matches in package.preload. */
+
+        lua_getfield(M, -1, "preload");
+
+        lua_pushnil(M);
+        while(lua_next(M, -2)) {
+            lua_pop(M, 1);
+
+            if (lua_type(M, -1) == LUA_TSTRING &&
+                    !strncmp(text + quoted, lua_tostring(M, -1),
+                             strlen(text + quoted))) {
+
+                lua_pushstring(M, text);
+                lua_rawseti (M, h, (n += 1));
+            }
+        }
+
+        lua_pop(M, 1);
+
+        /* Get the configuration (directory, path separators, module
+         * name wildcard). */
+
+        lua_getfield(M, -1, "config");
+        for (s = (char *)lua_tostring(M, -1), i = 0;
+             i < 3;
+             s = t + 1, i += 1) {
+
+            t = strchr(s, '\n');
+            lua_pushlstring(M, s, t - s);
+            strings[i] = lua_tostring(M, -1);
+        }
+
+        lua_remove(M, -4);
+
+        /* Get the path and cpath */
+
+        lua_getfield(M, -4, "path");
+        lua_pushstring(M, strings[1]);
+        lua_getfield(M, -6, "cpath");
+        lua_pushstring(M, strings[1]);
+        lua_concat(M, 4);
+
+        /* Turn the module name into a path. */
+
+        if (hasdot) {
+            luaL_gsub(M, text + quoted, ".", strings[0]);
+        } else {
+            lua_pushstring(M, text + quoted);
+        }
+
+        if (quoted) {
+            quote[0] = text[0];
+        }
+
+        for (b = d = lua_tostring(M, -2) ; d ; b = d + 1)  {
+            d = strstr(b, strings[1]);
+            q = strstr(b, strings[2]);
+
+            if (!q || q > d) {
+                continue;
+            }
+
+            n = add_modules (h, n, b, q, d, lua_tostring(M, -1),
+                             strings[0], quote);
+        }
+
+        lua_pop(M, 6);
+        save_index();
+
+        i = 0;
+    }
+
+    /* Return the next match from the table of matches. */
+
+    if (i < n) {
+        i += 1;
+
+        lua_rawgeti(M, -1, i);
+        match = strdup(lua_tostring(M, -1));
+        lua_pop(M, 1);
+
+        rl_completion_suppress_append = !(match[0] == '"' || match[0] == '\'');
+    } else {
+        /* Pop the table. */
+
+        lua_pop(M, 1);
+    }
+
+    return match;
+}
+#endif
+
+/* The sources of completions, which are only consulted if they can
+ * produce matches in the context of the text being completed. */
+
+#define SOURCE_KEYWORDS 1
+#define SOURCE_MODULES 2
+#define SOURCE_TABLE_KEYS 4
+#define SOURCE_METATABLE_KEYS 8
+#define SOURCE_FILE_NAMES 16
+
+static int long_bracket (const char *c, const char *e)
+{
+    int level;
+
+    /* Return the level of the long bracket opening at c, or -1 if
+     * there's none. */
+
+    if (c >= e || *c != '[') {
+        return -1;
+    }
+
+    for (c += 1, level = 0 ; c < e && *c == '=' ; c += 1, level += 1);
+
+    return c < e && *c == '[' ? level : -1;
+}
+
+static int is_word (const char *b, const char *c, const char *word)
+{
+    size_t n = strlen (word);
+
+    /* Check whether the token ending at c is the given word. */
+
+    return (size_t)(c - b) >= n && !strncmp (c - n, word, n) &&
+        (c - b == (ptrdiff_t)n ||
+         !(isalnum ((unsigned char)c[-n - 1]) || c[-n - 1] == '_'));
+}
+
+static int completion_sources (const char *text)
+{
+    const char *b, *c, *e;
+    char quote = 0;
+    int level = -1, comment = 0;
+    size_t n;
+
+    /* Find the text in the line.  If it's not there, as when
+     * completing on behalf of some other program, assume it's
+     * at the beginning of a statement. */
+
+    n = strlen (text);
+
+    if (rl_line_buffer && rl_point >= (int)n &&
+        !strncmp (rl_line_buffer + rl_point - n, text, n)) {
+        b = rl_line_buffer;
+        e = rl_line_buffer + rl_point - n;
+    } else {
+        b = e = text;
+    }
+
+    /* Scan the line up to the text, skipping over strings and
+     * comments, to see whether the text is part of one. */
+
+    for (c = b ; c < e ; c += 1) {
+        if (quote) {
+            if (*c == '\\') {
+                c += 1;
+            } else if (*c == quote) {
+                quote = 0;
+            }
+        } else if (level >= 0) {
+            if (*c == ']') {
+                const char *d;
+
+                for (d = c + 1 ; d < e && *d == '=' ; d += 1);
+
+                if (d < e && *d == ']' && d - c - 1 == level) {
+                    c = d;
+                    level = -1;
+                    comment = 0;
+                }
+            }
+        } else if (*c == '"' || *c == '\'') {
+            quote = *c;
+        } else if (*c == '-' && c + 1 < e && c[1] == '-') {
+            if ((level = long_bracket (c + 2, e)) < 0) {
+                return 0;
+            }
+
+            comment = 1;
+            c += level + 3;
+        } else if ((level = long_bracket (c, e)) >= 0) {
+            c += level + 1;
+        }
+    }
+
+    if (quote || level >= 0 || comment) {
+        return 0;
+    }
+
+    /* Find the token before the text. */
+
+    for (c = e ; c > b && isspace ((unsigned char)c[-1]) ; c -= 1);
+
+    /* A string can hold a module name if it's passed to require,
+     * or a file name otherwise. */
+
+    if (text[0] == '"' || text[0] == '\'') {
+        for (; c > b && (c[-1] == '(' || isspace ((unsigned char)c[-1])) ;
+             c -= 1);
+
+        return is_word (b, c, "require") ? SOURCE_MODULES : SOURCE_FILE_NAMES;
+    }
+
+    /* Numbers can't be completed and neither can names being
+     * declared, or labels. */
+
+    if (isdigit ((unsigned char)text[0]) ||
+        is_word (b, c, "for") || is_word (b, c, "goto") ||
+        (c - b >= 2 && c[-1] == ':' && c[-2] == ':')) {
+        return 0;
+    }
+
+    if (is_word (b, c, "local")) {
+        return strncmp (text, "function", n) ? 0 : SOURCE_KEYWORDS;
+    }
+
+    /* Table accesses can only be completed with table keys, or with
+     * the names of submodules, if the first name is unbound, or
+     * bound to a loaded module. */
+
+    if (strpbrk (text, ".:[")) {
+        int sources = SOURCE_TABLE_KEYS | SOURCE_METATABLE_KEYS;
+
+        if (!strpbrk (text, ":[") && !is_word (b, c, "function")) {
+            int h = lua_gettop (M);
+
+            lua_pushglobaltable (M);
+            lua_pushlstring (M, text, strcspn (text, "."));
+            lua_pushvalue (M, -1);
+            lua_rawget (M, h + 1);
+
+            if (lua_isnil (M, -1)) {
+                sources |= SOURCE_MODULES;
+            } else {
+                lua_getfield (M, LUA_REGISTRYINDEX, "_LOADED");
+
+                if (lua_istable (M, -1)) {
+                    lua_pushvalue (M, h + 2);
+                    lua_rawget (M, -2);
+
+                    if (lua_rawequal (M, -1, h + 3)) {
+                        sources |= SOURCE_MODULES;
+                    }
+                }
+            }
+
+            lua_settop (M, h);
+        }
+
+        return sources;
+    }
+
+    if (is_word (b, c, "function")) {
+        return SOURCE_TABLE_KEYS;
+    }
+
+    return SOURCE_KEYWORDS | SOURCE_MODULES | SOURCE_TABLE_KEYS |
+        SOURCE_METATABLE_KEYS;
+}
+
+static char *generator (const char *text, int state)
+{
+    static int which, sources;
+    char *match = NULL;
+
+    if (state == 0) {
+        which = 0;
+        sources = completion_sources (text);
+    }
+
+    /* Try to complete a keyword. */
+
+    if (which == 0) {
+#ifdef COMPLETE_KEYWORDS
+        if ((sources & SOURCE_KEYWORDS) &&
+            (match = keyword_completions (text, state))) {
+            return match;
+        }
+#endif
+        which += 1;
+        state = 0;
+    }
+
+    /* Try to complete a module name. */
+
+    if (which == 1) {
+#ifdef COMPLETE_MODULES
+        if ((sources & SOURCE_MODULES) &&
+            (match = module_completions (text, state))) {
+            return match;
+        }
+#endif
+        which += 1;
+        state = 0;
+    }
+
+    /* Try to complete a table access. */
+
+    if (which == 2) {
+#ifdef COMPLETE_TABLE_KEYS
+        look_up_metatable = 0;
+        if ((sources & SOURCE_TABLE_KEYS) &&
+            (match = table_key_completions (text, state))) {
+            return match;
+        }
+#endif
+        which += 1;
+        state = 0;
+    }
+
+    /* Try to complete a metatable access. */
+
+    if (which == 3) {
+#ifdef COMPLETE_METATABLE_KEYS
+        look_up_metatable = 1;
+        if ((sources & SOURCE_METATABLE_KEYS) &&
+            (match = table_key_completions (text, state))) {
+            return match;
+        }
+#endif
+        which += 1;
+        state = 0;
+    }
+
+#ifdef COMPLETE_FILE_NAMES
+    /* Try to complete a file name. */
+
+    if (which == 4) {
+        if (sources & SOURCE_FILE_NAMES) {
+            match = rl_filename_completion_function (text + 1, state);
+
+            if (match) {
+                struct stat s;
+                int n;
+
+                n = strlen (match);
+                stat(match, &s);
+
+                /* If a match was produced, add the quote
+                 * characters. */
+
+                match = (char *)realloc (match, n + 3);
+                memmove (match + 1, match, n);
+                match[0] = text[0];
+
+                /* If the file's a directory, add a trailing backslash
+                 * and suppress the space, otherwise add the closing
+                 * quote. */
+
+                if (S_ISDIR(s.st_mode)) {
+                    match[n + 1] = '/';
+
+                    rl_completion_suppress_append = 1;
+                } else {
+                    match[n + 1] = text[0];
+                }
+
+                match[n + 2] = '\0';
+            }
+        }
+    }
+#endif
+
+    return match;
+}
+#endif
+
+static void finish ()
+{
+#ifdef HAVE_READLINE_HISTORY
+    /* Save the command history on exit. */
+
+    if (logfile) {
+        write_history (logfile);
+    }
+#endif
+
+#if defined(HAVE_LIBREADLINE) && defined(COMPLETE_MODULES) && \
+    defined(DISCOVER_MODULES)
+    /* Save whatever has been discovered, in case no module name was
+     * completed during the session.  The index has to be loaded
+     * first, if that hasn't happened yet, so that listings which
+     * weren't rediscovered aren't dropped from it, and unchanged ones
+     * aren't needlessly written back. */
+
+    if (!listings_loaded) {
+        load_index ();
+    }
+
+    if (discovering) {
+        collect_discoveries ();
+    }
+
+    save_index ();
+#endif
+}
+
+static int traceback(lua_State *L)
+{
+    lua_Debug ar;
+    int i;
+
+    if (lua_isnoneornil (L, 1) ||
+        (!lua_isstring (L, 1) &&
+         !luaL_callmeta(L, 1, "__tostring"))) {
+        lua_pushliteral(L, "(no error message)");
+    }
+
+    if (lua_gettop (L) > 1) {
+        lua_replace (L, 1);
+        lua_settop (L, 1);
+    }
+
+    /* Print the Lua stack. */
+
+    lua_pushstring(L, "\n\nStack trace:\n");
+
+    for (i = 0 ; lua_getstack (L, i, &ar) ; i += 1) {
+#if LUA_VERSION_NUM == 501
+        lua_getinfo(M, "Snl", &ar);
+#else
+        lua_getinfo(M, "Snlt", &ar);
+
+        if (ar.istailcall) {
+            lua_pushfstring(L, "\t... tail calls\n");
+        }
+#endif
+
+        if (!strcmp (ar.what, "C")) {
+            lua_pushfstring(L, "\t#%d %s[C]:%s in function ",
+                            i, COLOR(7), COLOR(8));
+
+            if (ar.name) {
+                lua_pushfstring(L, "'%s%s%s'\n",
+                                COLOR(7), ar.name, COLOR(8));
+            } else {
+                lua_pushfstring(L, "%s?%s\n", COLOR(7), COLOR(8));
+            }
+        } else if (!strcmp (ar.what, "main")) {
+            lua_pushfstring(L, "\t#%d %s%s:%d:%s in the main chunk\n",
+                            i, COLOR(7), ar.short_src, ar.currentline,
+                            COLOR(8));
+        } else if (!strcmp (ar.what, "Lua")) {
+            lua_pushfstring(L, "\t#%d %s%s:%d:%s in function ",
+                            i, COLOR(7), ar.short_src, ar.currentline,
+                            COLOR(8));
+
+            if (ar.name) {
+                lua_pushfstring(L, "'%s%s%s'\n",
+                                COLOR(7), ar.name, COLOR(8));
+            } else {
+                lua_pushfstring(L, "%s?%s\n", COLOR(7), COLOR(8));
+            }
+        }
+    }
+
+    if (i == 0) {
+        lua_pushstring (L, "No activation records.\n");
+    }
+
+    lua_concat (L, lua_gettop(L));
+
+    return 1;
+}
+
+/* Results taller than the terminal can optionally be shown through a
+ * simple built-in pager, which is itself the writer the results are
+ * described to.  As it waits for a key press before passing on each
+ * page, the results are only described as far as they've been read,
+ * and the description is cut short, if the pager is quit.  Output is
+ * passed on a line at a time, so that it can be searched. */
+
+static int pager;
+
+typedef struct {
+    struct termios cooked;
+    int rows, columns, row, searching, quit;
+    char *line, pattern[128];
+    size_t length, size;
+} Pager;
+
+static int read_key (Pager *P)
+{
+    struct termios raw;
+    unsigned char c;
+    int n;
+
+    /* Read a single key press, without waiting for a newline.  This
+     * fails if we're interrupted. */
+
+    raw = P->cooked;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    tcsetattr (STDIN_FILENO, TCSANOW, &raw);
+    n = read (STDIN_FILENO, &c, 1);
+    tcsetattr (STDIN_FILENO, TCSANOW, &P->cooked);
+
+    return n == 1 ? c : -1;
+}
+
+static int read_pattern (Pager *P)
+{
+    char t[sizeof (P->pattern)];
+    size_t n;
+    char c;
+
+    /* Read a line, in cooked mode, and make it the pattern to search
+     * for, unless it's empty, in which case the last pattern is
+     * searched for again. */
+
+    print_output ("/");
+
+    for (n = 0 ; read (STDIN_FILENO, &c, 1) == 1 && c != '\n' ; ) {
+        if (n < sizeof (t) - 1) {
+            t[n] = c;
+            n += 1;
+        }
+    }
+
+    if (c != '\n') {
+        return -1;
+    }
+
+    if (n > 0) {
+        memcpy (P->pattern, t, n);
+        P->pattern[n] = '\0';
+    }
+
+    return 0;
+}
+
+static int page (Pager *P)
+{
+    /* Wait for the go-ahead before showing more. */
+
+    while (1) {
+        int c;
+
+        print_output ("%s--More--%s", COLOR(7), COLOR(0));
+        c = read_key (P);
+        print_output ("\r\033[K");
+
+        switch (c) {
+        case ' ':
+            P->row = 0;
+            return 0;
+        case '\n': case '\r':
+            P->row -= 1;
+            return 0;
+        case '/':
+            if (read_pattern (P) < 0) {
+                return 1;
+            }
+
+            print_output ("\033[A\r\033[K");
+            /* Fall through. */
+        case 'n':
+            if (P->pattern[0] != '\0') {
+                P->searching = 1;
+                P->row = 0;
+                return 0;
+            }
+
+            break;
+        case 'q': case 'Q': case -1:
+            return 1;
+        }
+    }
+}
+
+static int show_line (Pager *P)
+{
+    size_t i;
+    int w, r;
+
+    /* Find how many rows the line will take up on the terminal,
+     * skipping UTF-8 continuation bytes and escape sequences.  If
+     * they don't fit in the current page, page first. */
+
+    for (i = 0, w = 0 ; i < P->length ; i += 1) {
+        if (P->line[i] == '\033') {
+            while (i + 1 < P->length && !isalpha ((unsigned char)P->line[i])) {
+                i += 1;
+            }
+        } else if ((P->line[i] & 0xc0) != 0x80 && P->line[i] != '\n') {
+            w += 1;
+        }
+    }
+
+    r = w > 0 ? (w - 1) / P->columns + 1 : 1;
+
+    if (!P->searching && P->row > 0 && P->row + r > P->rows - 1 &&
+        page (P)) {
+        return 1;
+    }
+
+    /* Skip the line if we're searching and it doesn't match. */
+
+    P->line[P->length] = '\0';
+
+    if (P->searching) {
+        if (!strstr (P->line, P->pattern)) {
+            return 0;
+        }
+
+        P->searching = 0;
+    }
+
+    fwrite (P->line, 1, P->length, stdout);
+    P->row += r;
+
+    return 0;
+}
+
+static int page_writer (const char *s, size_t n, void *ud)
+{
+    Pager *P = (Pager *)ud;
+    size_t i;
+
+    for (i = 0 ; i < n && !P->quit ; i += 1) {
+        if (P->length + 1 >= P->size) {
+            P->size = P->size > 0 ? 2 * P->size : 256;
+            P->line = (char *)realloc (P->line, P->size);
+        }
+
+        P->line[P->length] = s[i];
+        P->length += 1;
+
+        if (s[i] == '\n') {
+            P->quit = show_line (P);
+            P->length = 0;
+        }
+    }
+
+    return P->quit;
+}
+
+static int open_pager (Pager *P)
+{
+#ifdef HAVE_IOCTL
+    struct winsize w;
+#endif
+
+    /* Page only when talking to a terminal. */
+
+    memset (P, 0, sizeof (Pager));
+
+    if (!pager || !isatty (STDIN_FILENO) || !isatty (STDOUT_FILENO) ||
+        tcgetattr (STDIN_FILENO, &P->cooked) < 0) {
+        return 0;
+    }
+
+    P->rows = 24;
+    P->columns = 80;
+
+#ifdef HAVE_IOCTL
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 &&
+        w.ws_row > 1 && w.ws_col > 0) {
+        P->rows = w.ws_row;
+        P->columns = w.ws_col;
+    }
+#endif
+
+    return 1;
+}
+
+static void close_pager (Pager *P)
+{
+    /* Show whatever's left of the last line. */
+
+    if (P->searching) {
+        print_output ("%sPattern not found.%s\n", COLOR(7), COLOR(0));
+    } else if (P->length > 0 && !P->quit) {
+        fwrite (P->line, 1, P->length, stdout);
+    }
+
+    fflush (stdout);
+    free (P->line);
+}
+
+static int execute ()
+{
+    struct sigaction newsigint, oldsigint;
+    int i, h_0, h, n, status, mask, count, paging;
+    luap_Writer w;
+    void *ud;
+    lua_Hook hook;
+    Pager P;
+    char t[64];
+
+#ifdef SAVE_RESULTS
+    /* Get the results table, and stash it behind the to-be-executed
+     * chunk. */
+
+    lua_rawgeti(M, LUA_REGISTRYINDEX, results);
+    lua_insert(M, -2);
+#endif
+
+    h_0 = lua_gettop(M);
+    status = luap_call (M, 0);
+    h = lua_gettop (M) - h_0 + 1;
+
+    /* Describing the results can take a while, so allow it to be
+     * interrupted.  Keep the current hook, so that it can be restored
+     * afterwards. */
+
+    interrupted = 0;
+    describer.interrupt = &interrupted;
+
+    hook = lua_gethook (M);
+    mask = lua_gethookmask (M);
+    count = lua_gethookcount (M);
+
+    newsigint.sa_handler = handle_describe_interrupt;
+    newsigint.sa_flags = 0;
+    sigemptyset (&newsigint.sa_mask);
+
+    sigaction(SIGINT, &newsigint, &oldsigint);
+
+    /* Print each value straight to the output, or through the pager,
+     * as it is being described. */
+
+    if ((paging = open_pager (&P))) {
+        w = page_writer;
+        ud = &P;
+    } else {
+        w = luap_filewriter;
+        ud = stdout;
+    }
+
+    for (i = h ; i > 0 ; i -= 1) {
+#ifdef SAVE_RESULTS
+        lua_pushvalue (M, -i);
+        lua_rawseti(M, h_0 - 1, (results_n += 1));
+#endif
+
+        /* Once interrupted, or told to quit by the pager, keep saving
+         * the remaining results, but stop describing them. */
+
+        if (interrupted || P.quit) {
+            continue;
+        }
+
+#ifdef SAVE_RESULTS
+        n = snprintf (t, sizeof (t), "%s%s[%d]%s = ",
+                      COLOR(4), RESULTS_TABLE_NAME, results_n, COLOR(3));
+#else
+        if (h == 1) {
+            n = snprintf (t, sizeof (t), "%s", COLOR(3));
+        } else {
+            n = snprintf (t, sizeof (t), "%s%d%s: ",
+                          COLOR(4), h - i + 1, COLOR(3));
+        }
+#endif
+
+        w (t, n, ud);
+        luap_describe_to (M, -i, w, ud);
+
+        n = snprintf (t, sizeof (t), "%s\n", COLOR(0));
+        w (t, n, ud);
+        fflush (stdout);
+    }
+
+    if (paging) {
+        close_pager (&P);
+    }
+
+    sigaction(SIGINT, &oldsigint, NULL);
+    describer.interrupt = NULL;
+    lua_sethook (M, hook, mask, count);
+
+    /* Clean up.  We need to remove the results table as well if we
+     * track results. */
+
+#ifdef SAVE_RESULTS
+    lua_settop (M, h_0 - 2);
+#else
+    lua_settop (M, h_0 - 1);
+#endif
+
+    return status;
+}
+
+/* This is the pretty-printing related stuff. */
+
+/* The dump buffer grows geometrically starting at DUMP_MIN_SIZE and
+ * is kept around between calls, so that describing a value doesn't
+ * normally need to allocate at all.  Buffers that have grown beyond
+ * DUMP_MAX_RETAINED_SIZE, after describing some unusually large
+ * value, are released instead. */
+
+#define DUMP_MIN_SIZE 256
+#define DUMP_MAX_RETAINED_SIZE (1 << 20)
+
+/* When describing to a writer, the buffer is passed on to it each
+ * time it fills up beyond DUMP_FLUSH_SIZE, so that the output can be
+ * consumed while it is still being produced.  If the writer fails,
+ * the traversal is cut short. */
+
+#define DUMP_FLUSH_SIZE 8192
+
+#define dump_literal(D, s) (check_fit(D, sizeof(s) - 1), \
+                         strcpy (D->dump + D->offset, s), \
+                         D->offset += sizeof(s) - 1, \
+                         D->column += sizeof(s) - 1)
+
+#define dump_character(D, c) (check_fit(D, 1), \
+                           D->dump[D->offset] = c, \
+                           D->offset += 1, \
+                           D->column += 1)
+
+/* Tables are laid out in the manner of Oppen's pretty-printer (see
+ * "Pretty Printing" by Derek C. Oppen), that is each table forms a
+ * group, which is kept on one line if it fits and broken up into
+ * several lines otherwise.  Instead of holding back the output until
+ * each group can be decided on, groups are written to the buffer as
+ * if they were to be kept on one line and the positions of the
+ * spaces that would have to become line breaks are noted.  As soon
+ * as the line overflows, the outermost undecided group is broken up,
+ * by rewriting its spaces in place.  The undecided part of the
+ * output never spans more than a line, so that this takes linear
+ * time overall and only that part needs to be kept in the buffer. */
+
+struct luap_Group {
+    int indent, breaks, entries;
+};
+
+struct luap_Break {
+    size_t offset;
+    int column;
+};
+
+static size_t settled_length (luap_Describer *D)
+{
+    /* Find the length of the part of the buffer that's final. */
+
+    return D->nbreaks > 0 ? D->breaks[0].offset : D->offset;
+}
+
+static void flush_dump (luap_Describer *D)
+{
+    size_t n;
+    int i;
+
+    /* Pass the final contents of the buffer on to the writer, if
+     * there is one.  Once the writer has failed, the output is
+     * discarded. */
+
+    n = settled_length (D);
+    D->spaced = 0;
+
+    if (D->writer && n > 0) {
+        if (D->status == 0) {
+            D->status = D->writer (D->dump, n, D->writer_data);
+        }
+
+        memmove (D->dump, D->dump + n, D->offset - n);
+
+        for (i = 0 ; i < D->nbreaks ; i += 1) {
+            D->breaks[i].offset -= n;
+        }
+
+        D->flushed += n;
+        D->offset -= n;
+    }
+}
+
+static void reserve_dump (luap_Describer *D, size_t size)
+{
+    /* Expand the buffer as necessary, so that a chunk will fit.  The
+     * capacity is doubled each time, so that the cost of copying is
+     * amortized over the whole dump. */
+
+    if (D->offset + size + 1 > D->length) {
+        size_t n;
+
+        for (n = D->length > 0 ? D->length : DUMP_MIN_SIZE;
+             n < D->offset + size + 1;
+             n *= 2);
+
+        D->dump = (char *)realloc (D->dump, n * sizeof (char));
+        D->length = n;
+    }
+}
+
+static void check_fit (luap_Describer *D, size_t size)
+{
+    /* Check if a chunk fits in the buffer, flushing it first if it
+     * has filled up with enough final output.  Whatever the chunk is,
+     * the output no longer ends in a separator. */
+
+    D->spaced = 0;
+
+    if (D->writer && D->offset + size > DUMP_FLUSH_SIZE &&
+        settled_length (D) >= DUMP_FLUSH_SIZE / 2) {
+        flush_dump (D);
+    }
+
+    reserve_dump (D, size);
+}
+
+static void trim_dump (luap_Describer *D)
+{
+    /* Release the buffer, as well as the stack of collected integer
+     * keys, if they have grown unusually large. */
+
+    if (D->length > DUMP_MAX_RETAINED_SIZE) {
+        free (D->dump);
+
+        D->dump = NULL;
+        D->length = 0;
+    }
+
+    if (D->maxkeys * sizeof (long long) > DUMP_MAX_RETAINED_SIZE) {
+        free (D->keys);
+
+        D->keys = NULL;
+        D->maxkeys = 0;
+    }
+}
+
+static int is_identifier (const char *s, int n)
+{
+    int i;
+
+    /* Check whether a string can be used as a key without quotes and
+     * braces. */
+
+    for (i = 0 ; i < n ; i += 1) {
+        if (!isalpha(s[i]) &&
+            (i == 0 || !isalnum(s[i])) &&
+            s[i] != '_') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void break_group (luap_Describer *D)
+{
+    struct luap_Group *g;
+    struct luap_Break *b;
+    size_t end, s;
+    int i, j, k, m, delta;
+
+    /* Break up the outermost undecided group, turning its breaks
+     * into line breaks.  Each stretch of output between them is
+     * moved into place, starting from the end. */
+
+    g = &D->groups[D->pending];
+    j = D->pending + 1 < D->ngroups ? g[1].breaks : D->nbreaks;
+    k = j - g->breaks;
+    m = g->indent;
+
+    D->pending += 1;
+
+    if (k == 0) {
+        return;
+    }
+
+    reserve_dump (D, (size_t)k * m);
+
+    for (i = j - 1, end = D->offset ; i >= g->breaks ; i -= 1) {
+        b = &D->breaks[i];
+        s = (size_t)(i - g->breaks) * m;
+
+        memmove (D->dump + b->offset + s + m + 1, D->dump + b->offset + 1,
+                 end - b->offset - 1);
+        D->dump[b->offset + s] = '\n';
+        memset (D->dump + b->offset + s + 1, ' ', m);
+
+        end = b->offset;
+    }
+
+    /* Everything after the last of the breaks is now on a line of
+     * its own, so shift it over. */
+
+    delta = m - D->breaks[j - 1].column - 1;
+    s = (size_t)k * m;
+
+    for (i = j ; i < D->nbreaks ; i += 1) {
+        D->breaks[i].offset += s;
+        D->breaks[i].column += delta;
+    }
+
+    for (i = D->pending ; i < D->ngroups ; i += 1) {
+        D->groups[i].indent += delta;
+        D->groups[i].breaks -= k;
+    }
+
+    memmove (D->breaks + g->breaks, D->breaks + j,
+             (D->nbreaks - j) * sizeof (struct luap_Break));
+
+    D->nbreaks -= k;
+    D->offset += s;
+    D->dump[D->offset] = '\0';
+    D->column += delta;
+    D->indent = D->groups[D->ngroups - 1].indent;
+}
+
+static void fit_groups (luap_Describer *D, int l)
+{
+    /* Break up undecided groups, until a chunk of printed width l
+     * fits on the line, or there are no more. */
+
+    while (D->pending < D->ngroups && D->column + l > D->columns) {
+        break_group (D);
+    }
+}
+
+static void settle_groups (luap_Describer *D)
+{
+    /* Break up all undecided groups, because the output is about to
+     * span several lines anyway. */
+
+    while (D->pending < D->ngroups) {
+        break_group (D);
+    }
+}
+
+static void break_line (luap_Describer *D)
+{
+    int i;
+
+    /* Take back the space of a separator, if that's what precedes
+     * the break, so that it isn't left at the end of the line. */
+
+    if (D->spaced) {
+        D->offset -= 1;
+    }
+
+    check_fit (D, D->indent + 1);
+
+    /* Add a line break. */
+
+    D->dump[D->offset] = '\n';
+
+    /* And indent to the current level. */
+
+    for (i = 1 ; i <= D->indent ; i += 1) {
+        D->dump[D->offset + i] = ' ';
+    }
+
+    D->offset += D->indent + 1;
+    D->column = D->indent;
+}
+
+static void dump_raw (luap_Describer *D, const char *s, size_t n, int l)
+{
+    /* Copy a chunk of printed width l to the buffer as is. */
+
+    D->column += l;
+
+    /* Large chunks are passed on to the writer directly, instead of
+     * being copied into the buffer first. */
+
+    if (D->writer && n >= DUMP_FLUSH_SIZE) {
+        settle_groups (D);
+        flush_dump (D);
+
+        if (D->status == 0) {
+            D->status = D->writer (s, n, D->writer_data);
+        }
+
+        D->flushed += n;
+
+        return;
+    }
+
+    check_fit (D, n);
+
+    /* Copy the string to the buffer. */
+
+    memcpy (D->dump + D->offset, s, n);
+    D->dump[D->offset + n] = '\0';
+
+    D->offset += n;
+}
+
+static void dump_color (luap_Describer *D, int i)
+{
+    /* Color escape sequences take up no room on the line. */
+
+    if (D->colorize) {
+        dump_raw (D, colors[i], strlen (colors[i]), 0);
+    }
+}
+
+static void dump_fit (luap_Describer *D, int l)
+{
+    /* Break the line if a chunk of printed width l doesn't fit, even
+     * after breaking up any undecided groups, but it would fit if we
+     * started on a fresh line at the current indent. */
+
+    fit_groups (D, l);
+
+    if (D->column + l > D->columns && D->indent + l <= D->columns) {
+        break_line(D);
+    }
+}
+
+static void open_group (luap_Describer *D)
+{
+    /* Open an undecided group at the current column.  If it's broken
+     * up, its contents are indented to the column after the next. */
+
+    if (D->ngroups == D->maxgroups) {
+        D->maxgroups = D->maxgroups > 0 ? 2 * D->maxgroups : 16;
+        D->groups = (struct luap_Group *)realloc (
+            D->groups, D->maxgroups * sizeof (struct luap_Group));
+    }
+
+    D->groups[D->ngroups].indent = D->column + 1;
+    D->groups[D->ngroups].breaks = D->nbreaks;
+    D->groups[D->ngroups].entries = 0;
+    D->ngroups += 1;
+
+    D->indent = D->column + 1;
+}
+
+static void dump_break (luap_Describer *D, int hard)
+{
+    /* Separate two entries of the current group with a space.  Hard
+     * breaks turn into line breaks if the group is broken up. */
+
+    fit_groups (D, 0);
+
+    if (hard && D->pending == D->ngroups) {
+        break_line (D);
+
+        return;
+    }
+
+    check_fit (D, 1);
+
+    if (hard) {
+        if (D->nbreaks == D->maxbreaks) {
+            D->maxbreaks = D->maxbreaks > 0 ? 2 * D->maxbreaks : 64;
+            D->breaks = (struct luap_Break *)realloc (
+                D->breaks, D->maxbreaks * sizeof (struct luap_Break));
+        }
+
+        D->breaks[D->nbreaks].offset = D->offset;
+        D->breaks[D->nbreaks].column = D->column;
+        D->nbreaks += 1;
+    }
+
+    D->dump[D->offset] = ' ';
+    D->offset += 1;
+    D->column += 1;
+    D->spaced = !hard;
+}
+
+static void dump_equals (luap_Describer *D)
+{
+    /* Separate a key from its value, which may still have to go on
+     * the next line, taking the space back. */
+
+    dump_literal (D, " = ");
+    D->spaced = 1;
+}
+
+static void close_group (luap_Describer *D, char c, int comma)
+{
+    int broken;
+
+    /* Close the current group with the bracket c, on the same line
+     * if it's still undecided, since it then fits, or on a line of
+     * its own otherwise.  A comma follows the last entry in the
+     * latter case, if requested. */
+
+    fit_groups (D, 2);
+
+    broken = (D->pending == D->ngroups);
+    D->ngroups -= 1;
+    D->indent = D->ngroups > 0 ? D->groups[D->ngroups - 1].indent : 0;
+
+    if (broken) {
+        D->pending = D->ngroups;
+
+        if (comma) {
+            dump_literal (D, ",");
+        }
+
+        break_line (D);
+        dump_raw (D, &c, 1, 1);
+    } else {
+        D->nbreaks = D->groups[D->ngroups].breaks;
+        dump_literal (D, " ");
+        dump_raw (D, &c, 1, 1);
+    }
+}
+
+static void dump_text (luap_Describer *D, const char *s, size_t n, int l)
+{
+    dump_fit (D, l);
+    dump_raw (D, s, n, l);
+}
+
+static void dump_keyword (luap_Describer *D, const char *s, size_t n)
+{
+    /* Dump a highlighted word, such as nil. */
+
+    dump_fit (D, n);
+    dump_color (D, 7);
+    dump_raw (D, s, n, n);
+    dump_color (D, 8);
+}
+
+static void dump_opaque (luap_Describer *D, const char *what, size_t n,
+                         const void *p)
+{
+    char t[2 * sizeof (void *) + 2];
+    uintptr_t u;
+    int m;
+
+    /* Dump a value that can only be told apart by its address, as in
+     * "<function: 0x5581c1a8>".  The address is formatted in place,
+     * rather than with printf. */
+
+    u = (uintptr_t)p;
+    m = sizeof (t);
+
+    do {
+        t[--m] = "0123456789abcdef"[u & 15];
+        u >>= 4;
+    } while (u > 0);
+
+    t[--m] = 'x';
+    t[--m] = '0';
+
+    dump_fit (D, n + sizeof (t) - m + 3);
+    dump_literal (D, "<");
+    dump_color (D, 7);
+    dump_raw (D, what, n, n);
+    dump_color (D, 8);
+    dump_literal (D, " ");
+    dump_raw (D, t + m, sizeof (t) - m, sizeof (t) - m);
+    dump_literal (D, ">");
+}
+
+/* Find the length of the initial run of bytes in s, which are
+ * printable ASCII characters other than a and b.  This is used to
+ * skip over the bytes of strings that need no special treatment, 16
+ * or 32 bytes at a time where SIMD instructions are available. */
+
+#define is_plain(c, a, b) ((c) >= 0x20 && (c) < 0x7f && (c) != (a) && (c) != (b))
+
+static size_t plain_span (const char *s, size_t n, int a, int b)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i space = _mm256_set1_epi8(' '), del = _mm256_set1_epi8(0x7f);
+    const __m256i A = _mm256_set1_epi8(a), B = _mm256_set1_epi8(b);
+
+    for (; i + 32 <= n ; i += 32) {
+        __m256i v, m;
+        unsigned int mask;
+
+        /* Bytes over 0x7f are negative and thus also compare less
+         * than a space. */
+
+        v = _mm256_loadu_si256 ((const __m256i *)(s + i));
+        m = _mm256_or_si256 (
+            _mm256_or_si256 (_mm256_cmpgt_epi8 (space, v),
+                             _mm256_cmpeq_epi8 (v, del)),
+            _mm256_or_si256 (_mm256_cmpeq_epi8 (v, A),
+                             _mm256_cmpeq_epi8 (v, B)));
+
+        if ((mask = _mm256_movemask_epi8 (m))) {
+            return i + __builtin_ctz (mask);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' '), del = _mm_set1_epi8(0x7f);
+    const __m128i A = _mm_set1_epi8(a), B = _mm_set1_epi8(b);
+
+    for (; i + 16 <= n ; i += 16) {
+        __m128i v, m;
+        unsigned int mask;
+
+        /* Bytes over 0x7f are negative and thus also compare less
+         * than a space. */
+
+        v = _mm_loadu_si128 ((const __m128i *)(s + i));
+        m = _mm_or_si128 (
+            _mm_or_si128 (_mm_cmplt_epi8 (v, space),
+                          _mm_cmpeq_epi8 (v, del)),
+            _mm_or_si128 (_mm_cmpeq_epi8 (v, A),
+                          _mm_cmpeq_epi8 (v, B)));
+
+        if ((mask = _mm_movemask_epi8 (m))) {
+            return i + __builtin_ctz (mask);
+        }
+    }
+#endif
+
+    for (; i < n && is_plain((unsigned char)s[i], a, b) ; i += 1);
+
+    return i;
+}
+
+static int width (const char *s, size_t n)
+{
+    size_t i, k;
+    int c, l, w;
+
+    /* Calculate the printed width of the chunk s.  Runs of plain
+     * ASCII characters are measured in bulk.  Escape sequences take
+     * up no room, while multibyte UTF-8 sequences take up as many
+     * columns as wcwidth says, or one, if it doesn't know. */
+
+    for (i = 0, l = 0 ; i < n ; ) {
+        k = plain_span (s + i, n - i, '\033', '\033');
+        i += k;
+        l += k;
+
+        if (i == n) {
+            break;
+        }
+
+        c = (unsigned char)s[i];
+
+        if (c == '\033') {
+            for (; i < n && s[i] != 'm' ; i += 1);
+            i += 1;
+        } else if (c < 0xc0 || c >= 0xf8) {
+            /* Control characters and stray or invalid UTF-8 bytes. */
+
+            l += 1;
+            i += 1;
+        } else {
+            /* Decode the sequence. */
+
+            k = c < 0xe0 ? 2 : (c < 0xf0 ? 3 : 4);
+            c &= 0x7f >> k;
+
+            for (i += 1, k -= 1 ; k > 0 && i < n ; i += 1, k -= 1) {
+                if ((s[i] & 0xc0) != 0x80) {
+                    break;
+                }
+
+                c = (c << 6) | (s[i] & 0x3f);
+            }
+
+            l += (k > 0 || (w = wcwidth (c)) < 0) ? 1 : w;
+        }
+    }
+
+    return l;
+}
+
+static void dump_string (luap_Describer *D, const char *s, size_t n)
+{
+    size_t i;
+
+    /* Chunks spanning multiple lines never need a line break.  We
+     * just need to know how much of the last line they take up. */
+
+    for (i = n ; i > 0 && s[i - 1] != '\n' ; i -= 1);
+
+    if (i > 0) {
+        settle_groups (D);
+        dump_raw (D, s, n, 0);
+        D->column = width (s + i, n - i);
+    } else {
+        dump_text (D, s, n, width (s, n));
+    }
+}
+
+static int cut_short (luap_Describer *D, int shown)
+{
+    /* Check whether the traversal of a table should be cut short,
+     * after having shown the specified number of its entries, either
+     * because the writer has failed, because a budget has been
+     * exhausted, or because we've been interrupted. */
+
+    if (D->max_total > 0 && D->flushed + D->offset >= (size_t)D->max_total) {
+        D->exhausted = 1;
+    }
+
+    if (D->max_steps > 0 && D->steps >= (unsigned long)D->max_steps) {
+        D->exhausted = 1;
+    }
+
+    if (D->interrupt && *D->interrupt) {
+        D->exhausted = 1;
+        D->interrupted = 1;
+    }
+
+    return (D->status != 0 || D->exhausted ||
+            (D->max_entries > 0 && shown >= D->max_entries));
+}
+
+static void dump_elision (luap_Describer *D, unsigned long n, const char *what)
+{
+    char t[32];
+    int l;
+
+    /* Make a note that n somethings have been left out. */
+
+    dump_color (D, 7);
+    dump_literal (D, "...");
+    dump_color (D, 8);
+
+    if (n > 0) {
+        l = sprintf (t, " %lu %s", n, what);
+        dump_text (D, t, l, l);
+    }
+}
+
+/* Numbers are formatted straight into a character array, rather
+ * than converted to Lua strings, which would then have to be
+ * interned and collected.  Floats are first converted to the
+ * shortest string of digits that reads back as the same number,
+ * using Grisu2 (see "Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers" by Florian Loitsch).  When the output
+ * is to be formatted as with "%.14g" (Lua's LUA_NUMBER_FMT), these
+ * are exactly the digits printf would produce, as long as there are
+ * no more than 14 of them.  Anything else is left to snprintf. */
+
+#define NUMBER_SIZE 64
+
+typedef struct {
+    uint64_t f;
+    int e;
+} diyfp;
+
+static diyfp multiply (diyfp x, diyfp y)
+{
+    uint64_t a, b, c, d, t;
+    diyfp z;
+
+    /* Keep the upper half of the 128-bit product, rounded. */
+
+    a = x.f >> 32;
+    b = x.f & 0xffffffff;
+    c = y.f >> 32;
+    d = y.f & 0xffffffff;
+
+    t = ((b * d) >> 32) + ((a * d) & 0xffffffff) + ((b * c) & 0xffffffff);
+    t += (uint64_t)1 << 31;
+
+    z.f = a * c + ((a * d) >> 32) + ((b * c) >> 32) + (t >> 32);
+    z.e = x.e + y.e + 64;
+
+    return z;
+}
+
+static diyfp normalize (diyfp x)
+{
+    while (!(x.f & ((uint64_t)1 << 63))) {
+        x.f <<= 1;
+        x.e -= 1;
+    }
+
+    return x;
+}
+
+static void grisu_round (char *digits, int n, uint64_t delta, uint64_t rest,
+                         uint64_t ten_kappa, uint64_t wp_w)
+{
+    /* Move the last digit closer to the exact value, as long as the
+     * result stays within the rounding interval. */
+
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w ||
+            wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[n - 1] -= 1;
+        rest += ten_kappa;
+    }
+}
+
+static int grisu2 (double x, char *digits, int *K)
+{
+    /* These are the normalized powers of ten, from 10^-348 to 10^340
+     * in steps of 8. */
+
+    static const uint64_t powers_f[] = {
+        0xfa8fd5a0081c0288, 0xbaaee17fa23ebf76, 0x8b16fb203055ac76,
+        0xcf42894a5dce35ea, 0x9a6bb0aa55653b2d, 0xe61acf033d1a45df,
+        0xab70fe17c79ac6ca, 0xff77b1fcbebcdc4f, 0xbe5691ef416bd60c,
+        0x8dd01fad907ffc3c, 0xd3515c2831559a83, 0x9d71ac8fada6c9b5,
+        0xea9c227723ee8bcb, 0xaecc49914078536d, 0x823c12795db6ce57,
+        0xc21094364dfb5637, 0x9096ea6f3848984f, 0xd77485cb25823ac7,
+        0xa086cfcd97bf97f4, 0xef340a98172aace5, 0xb23867fb2a35b28e,
+        0x84c8d4dfd2c63f3b, 0xc5dd44271ad3cdba, 0x936b9fcebb25c996,
+        0xdbac6c247d62a584, 0xa3ab66580d5fdaf6, 0xf3e2f893dec3f126,
+        0xb5b5ada8aaff80b8, 0x87625f056c7c4a8b, 0xc9bcff6034c13053,
+        0x964e858c91ba2655, 0xdff9772470297ebd, 0xa6dfbd9fb8e5b88f,
+        0xf8a95fcf88747d94, 0xb94470938fa89bcf, 0x8a08f0f8bf0f156b,
+        0xcdb02555653131b6, 0x993fe2c6d07b7fac, 0xe45c10c42a2b3b06,
+        0xaa242499697392d3, 0xfd87b5f28300ca0e, 0xbce5086492111aeb,
+        0x8cbccc096f5088cc, 0xd1b71758e219652c, 0x9c40000000000000,
+        0xe8d4a51000000000, 0xad78ebc5ac620000, 0x813f3978f8940984,
+        0xc097ce7bc90715b3, 0x8f7e32ce7bea5c70, 0xd5d238a4abe98068,
+        0x9f4f2726179a2245, 0xed63a231d4c4fb27, 0xb0de65388cc8ada8,
+        0x83c7088e1aab65db, 0xc45d1df942711d9a, 0x924d692ca61be758,
+        0xda01ee641a708dea, 0xa26da3999aef774a, 0xf209787bb47d6b85,
+        0xb454e4a179dd1877, 0x865b86925b9bc5c2, 0xc83553c5c8965d3d,
+        0x952ab45cfa97a0b3, 0xde469fbd99a05fe3, 0xa59bc234db398c25,
+        0xf6c69a72a3989f5c, 0xb7dcbf5354e9bece, 0x88fcf317f22241e2,
+        0xcc20ce9bd35c78a5, 0x98165af37b2153df, 0xe2a0b5dc971f303a,
+        0xa8d9d1535ce3b396, 0xfb9b7cd9a4a7443c, 0xbb764c4ca7a44410,
+        0x8bab8eefb6409c1a, 0xd01fef10a657842c, 0x9b10a4e5e9913129,
+        0xe7109bfba19c0c9d, 0xac2820d9623bf429, 0x80444b5e7aa7cf85,
+        0xbf21e44003acdd2d, 0x8e679c2f5e44ff8f, 0xd433179d9c8cb841,
+        0x9e19db92b4e31ba9, 0xeb96bf6ebadf77d9, 0xaf87023b9bf0ee6b
+    };
+
+    static const short powers_e[] = {
+        -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007,
+        -980, -954, -927, -901, -874, -847, -821, -794, -768, -741,
+        -715, -688, -661, -635, -608, -582, -555, -529, -502, -475,
+        -449, -422, -396, -369, -343, -316, -289, -263, -236, -210,
+        -183, -157, -130, -103, -77, -50, -24, 3, 30, 56, 83, 109,
+        136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428,
+        455, 481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747,
+        774, 800, 827, 853, 880, 907, 933, 960, 986, 1013, 1039, 1066
+    };
+
+    static const uint64_t tens[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+        10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+        100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+        100000000000000000ULL, 1000000000000000000ULL,
+        10000000000000000000ULL
+    };
+
+    union {
+        double x;
+        uint64_t n;
+    } u;
+
+    diyfp v, w, p, m, c, one;
+    uint64_t delta, wp_w, p2, r;
+    uint32_t p1, d;
+    double dk;
+    int e, i, k, n, kappa;
+
+    /* Decompose the (positive, finite and non-zero) number and find
+     * the boundaries of the interval of numbers that round to it. */
+
+    u.x = x;
+    e = (u.n >> 52) & 0x7ff;
+    v.f = u.n & (((uint64_t)1 << 52) - 1);
+
+    if (e > 0) {
+        v.f += (uint64_t)1 << 52;
+        v.e = e - 1075;
+    } else {
+        v.e = -1074;
+    }
+
+    p.f = (v.f << 1) + 1;
+    p.e = v.e - 1;
+    p = normalize (p);
+
+    if (v.f == (uint64_t)1 << 52) {
+        m.f = (v.f << 2) - 1;
+        m.e = v.e - 2;
+    } else {
+        m.f = (v.f << 1) - 1;
+        m.e = v.e - 1;
+    }
+
+    m.f <<= m.e - p.e;
+    m.e = p.e;
+
+    /* Scale everything by a cached power of ten, so that the upper
+     * boundary ends up with a binary exponent in [-60, -32]. */
+
+    dk = (-61 - p.e) * 0.30102999566398114 + 347;
+    k = (int)dk;
+
+    if (dk - k > 0.0) {
+        k += 1;
+    }
+
+    i = (k >> 3) + 1;
+    c.f = powers_f[i];
+    c.e = powers_e[i];
+    *K = 348 - i * 8;
+
+    w = multiply (normalize (v), c);
+    p = multiply (p, c);
+    m = multiply (m, c);
+    m.f += 1;
+    p.f -= 1;
+
+    /* Generate the digits of the upper boundary until the result
+     * falls within the interval. */
+
+    delta = p.f - m.f;
+    wp_w = p.f - w.f;
+    one.e = p.e;
+    one.f = (uint64_t)1 << -one.e;
+    p1 = p.f >> -one.e;
+    p2 = p.f & (one.f - 1);
+
+    for (kappa = 1 ; kappa < 10 && p1 >= tens[kappa] ; kappa += 1);
+
+    n = 0;
+
+    while (kappa > 0) {
+        d = p1 / tens[kappa - 1];
+        p1 %= tens[kappa - 1];
+
+        if (d || n) {
+            digits[n++] = '0' + d;
+        }
+
+        kappa -= 1;
+        r = ((uint64_t)p1 << -one.e) + p2;
+
+        if (r <= delta) {
+            *K += kappa;
+            grisu_round (digits, n, delta, r, tens[kappa] << -one.e, wp_w);
+
+            return n;
+        }
+    }
+
+    while (1) {
+        p2 *= 10;
+        delta *= 10;
+        d = p2 >> -one.e;
+
+        if (d || n) {
+            digits[n++] = '0' + d;
+        }
+
+        p2 &= one.f - 1;
+        kappa -= 1;
+
+        if (p2 < delta) {
+            *K += kappa;
+            grisu_round (digits, n, delta, p2, one.f,
+                         wp_w * (-kappa < 20 ? tens[-kappa] : 0));
+
+            return n;
+        }
+    }
+}
+
+static int format_integer (char *t, long long n)
+{
+    char s[24], *c;
+    unsigned long long u;
+    int l;
+
+    u = n < 0 ? -(unsigned long long)n : (unsigned long long)n;
+    c = s + sizeof (s);
+
+    do {
+        *--c = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+
+    if (n < 0) {
+        *--c = '-';
+    }
+
+    l = s + sizeof (s) - c;
+    memcpy (t, c, l);
+
+    return l;
+}
+
+static int format_float (char *t, lua_Number x, int shortest)
+{
+    char digits[20];
+    int i, l, n, K, X, precision;
+
+    /* Leave anything we can't handle to snprintf.  This includes
+     * infinities and NaNs, which are printed in a system-dependent
+     * way. */
+
+    if (x != x || x - x != 0 ||
+        (!shortest && (sizeof (lua_Number) != sizeof (double) ||
+                       strcmp (LUA_NUMBER_FMT, "%.14g")))) {
+        return snprintf (t, NUMBER_SIZE - 2, LUA_NUMBER_FMT,
+                         (LUAI_UACNUMBER)x);
+    }
+
+    l = 0;
+
+    if (x < 0 || (x == 0 && 1 / x < 0)) {
+        t[l++] = '-';
+        x = -x;
+    }
+
+    if (x == 0) {
+        t[l++] = '0';
+        t[l] = '\0';
+
+        return l;
+    }
+
+    /* Subnormal numbers have fewer significant digits, so more
+     * than one string of 14 digits might read back as the same
+     * number. */
+
+    if (!shortest && x < 2.2250738585072014e-308) {
+        return l + snprintf (t + l, NUMBER_SIZE - 2 - l, "%.14g", (double)x);
+    }
+
+    n = grisu2 ((double)x, digits, &K);
+    precision = shortest ? 17 : 14;
+
+    if (n > precision) {
+        return l + snprintf (t + l, NUMBER_SIZE - 2 - l, "%.14g", (double)x);
+    }
+
+    /* Format the digits as %g would, that is in scientific notation
+     * if the exponent X of the first digit is less than -4 or at
+     * least the precision, and as a plain decimal number otherwise,
+     * without trailing zeros. */
+
+    X = n + K - 1;
+
+    if (X < -4 || X >= precision) {
+        t[l++] = digits[0];
+
+        if (n > 1) {
+            t[l++] = '.';
+            memcpy (t + l, digits + 1, n - 1);
+            l += n - 1;
+        }
+
+        t[l++] = 'e';
+        t[l++] = X < 0 ? '-' : '+';
+        X = X < 0 ? -X : X;
+
+        if (X >= 100) {
+            t[l++] = '0' + X / 100;
+        }
+
+        t[l++] = '0' + X / 10 % 10;
+        t[l++] = '0' + X % 10;
+    } else if (X >= 0) {
+        for (i = 0 ; i <= X ; i += 1) {
+            t[l++] = i < n ? digits[i] : '0';
+        }
+
+        if (n > X + 1) {
+            t[l++] = '.';
+            memcpy (t + l, digits + X + 1, n - X - 1);
+            l += n - X - 1;
+        }
+    } else {
+        t[l++] = '0';
+        t[l++] = '.';
+
+        for (i = -1 ; i > X ; i -= 1) {
+            t[l++] = '0';
+        }
+
+        memcpy (t + l, digits, n);
+        l += n;
+    }
+
+    t[l] = '\0';
+
+    return l;
+}
+
+static int format_number (luap_Describer *D, lua_State *L, int index,
+                          char *t)
+{
+    int l;
+
+    /* Format a number as tostring would, or, if round-trip output
+     * has been requested, with as many digits as needed to read the
+     * number back exactly.  The array should have room for
+     * NUMBER_SIZE characters. */
+
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger (L, index)) {
+        return format_integer (t, (long long)lua_tointeger (L, index));
+    }
+#endif
+
+    l = format_float (t, lua_tonumber (L, index), D->roundtrip);
+
+    /* Make sure floats look like floats. */
+
+#if LUA_VERSION_NUM >= 503
+    if (strspn (t, "-0123456789") == (size_t)l) {
+        t[l++] = '.';
+        t[l++] = '0';
+    }
+#endif
+
+    return l;
+}
+
+static void describe_string (luap_Describer *D, const char *s, size_t n)
+{
+    size_t i;
+    int c, started, score, level, uselevel = 0;
+
+    /* Scan the string to decide how to print it.  Runs of plain
+     * characters don't affect the decision and are skipped in bulk,
+     * unless we're in the middle of a potential closing long
+     * bracket. */
+
+    for (i = 0, score = n, started = 0 ; i < n ; i += 1) {
+        if (!started && (i += plain_span (s + i, n - i, ']', ']')) == n) {
+            break;
+        }
+
+        c = (unsigned char)s[i];
+
+        if (c == '\n' || c == '\t' || c == '\v' || c == '\r') {
+            /* These characters show up better in a long sting so
+             * bias towards that. */
+
+            score += D->columns / 2;
+        } else if (c == '\a' || c == '\b' || c == '\f' || !isprint(c)) {
+            /* These however go better with an escaped short
+             * string (unless you like the bell or weird
+             * characters). */
+
+            score -= D->columns / 4;
+        }
+
+        /* Check what long string delimeter level to use so that
+         * the string won't be closed prematurely. */
+
+        if (!started) {
+            if (c == ']') {
+                started = 1;
+                level = 0;
+            }
+        } else {
+            if (c == '=') {
+                level += 1;
+            } else if (c == ']') {
+                if (level >= uselevel) {
+                    uselevel = level + 1;
+                }
+            } else {
+                started = 0;
+            }
+        }
+    }
+
+    if (score > D->columns) {
+        /* Dump the string as a long string. */
+
+        settle_groups (D);
+        dump_character (D, '[');
+        for (i = 0 ; i < (size_t)uselevel ; i += 1) {
+            dump_character (D, '=');
+        }
+        dump_literal (D, "[\n");
+        D->column = 0;
+
+        dump_string (D, s, n);
+
+        dump_character (D, ']');
+        for (i = 0 ; i < (size_t)uselevel ; i += 1) {
+            dump_character (D, '=');
+        }
+        dump_literal (D, "]");
+    } else {
+        dump_literal (D, "\"");
+
+#ifdef ESCAPE_STRINGS
+        /* Escape the string as needed and print it as a normal
+         * string.  Runs of characters that need no escaping are
+         * copied as they are. */
+
+        for (i = 0 ; i < n ; i += 1) {
+            size_t m;
+            char t[4];
+
+            if ((m = plain_span (s + i, n - i, '"', '\\')) > 0) {
+                dump_raw (D, s + i, m, m);
+
+                if ((i += m) == n) {
+                    break;
+                }
+            }
+
+            c = (unsigned char)s[i];
+            t[0] = '\\';
+
+            switch (c) {
+            case '"': case '\\': t[1] = c; break;
+            case '\a': t[1] = 'a'; break;
+            case '\b': t[1] = 'b'; break;
+            case '\f': t[1] = 'f'; break;
+            case '\n': t[1] = 'n'; break;
+            case '\r': t[1] = 'r'; break;
+            case '\t': t[1] = 't'; break;
+            case '\v': t[1] = 'v'; break;
+            default:
+                if (isprint(c)) {
+                    dump_raw (D, s + i, 1, 1);
+                } else {
+                    t[1] = '0' + c / 100;
+                    t[2] = '0' + c / 10 % 10;
+                    t[3] = '0' + c % 10;
+
+                    dump_fit (D, 4);
+                    dump_raw (D, t, 4, 4);
+                }
+
+                continue;
+            }
+
+            dump_raw (D, t, 2, 2);
+        }
+#else
+        dump_raw (D, s, n, n);
+#endif
+
+        dump_literal (D, "\"");
+    }
+}
+
+static int in_array_part (lua_State *L, int index, int l)
+{
+    lua_Number x;
+
+    /* Check whether the key at the specified index lies within an
+     * array part of length l.  Keys are classified with a single
+     * conversion each. */
+
+    if (lua_type (L, index) != LUA_TNUMBER) {
+        return 0;
+    }
+
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger (L, index)) {
+        lua_Integer k = lua_tointeger (L, index);
+
+        return k >= 1 && k <= l;
+    }
+#endif
+
+    x = lua_tonumber (L, index);
+
+    return x >= 1 && x <= l && x == (lua_Number)(int)x;
+}
+
+/* Hosts can register native describers for values with a given
+ * metatable, typically userdata, which are then called instead of
+ * __tostring metamethods to dump the value straight into the
+ * description.  They're kept in a table in the registry, keyed by the
+ * metatable.  The table is only there while some describer is, so
+ * that describe can skip the lookup cheaply, in the common case where
+ * there are none. */
+
+static char describers_key;
+
+void luap_register_describer (lua_State *L, int index, luap_DescribeFunction f)
+{
+    index = absolute (L, index);
+
+    lua_pushlightuserdata (L, &describers_key);
+    lua_rawget (L, LUA_REGISTRYINDEX);
+
+    if (lua_isnil (L, -1)) {
+        lua_pop (L, 1);
+        lua_newtable (L);
+        lua_pushlightuserdata (L, &describers_key);
+        lua_pushvalue (L, -2);
+        lua_rawset (L, LUA_REGISTRYINDEX);
+    }
+
+    /* Function pointers can't portably be stored in light userdata,
+     * so store them in full userdata instead. */
+
+    lua_pushvalue (L, index);
+
+    if (f) {
+        *(luap_DescribeFunction *)lua_newuserdata (
+            L, sizeof (luap_DescribeFunction)) = f;
+    } else {
+        lua_pushnil (L);
+    }
+
+    lua_rawset (L, -3);
+
+    /* Remove the table along with the last describer. */
+
+    lua_pushnil (L);
+
+    if (lua_next (L, -2)) {
+        lua_pop (L, 2);
+    } else {
+        lua_pushlightuserdata (L, &describers_key);
+        lua_pushnil (L);
+        lua_rawset (L, LUA_REGISTRYINDEX);
+    }
+
+    lua_pop (L, 1);
+}
+
+static luap_DescribeFunction find_describer (lua_State *L, int index)
+{
+    luap_DescribeFunction f = NULL;
+    int type;
+
+    index = absolute (L, index);
+    type = lua_type (L, index);
+
+    if (type != LUA_TUSERDATA && type != LUA_TTABLE) {
+        return NULL;
+    }
+
+    lua_pushlightuserdata (L, &describers_key);
+    lua_rawget (L, LUA_REGISTRYINDEX);
+
+    if (!lua_istable (L, -1) || !lua_getmetatable (L, index)) {
+        lua_pop (L, 1);
+
+        return NULL;
+    }
+
+    lua_rawget (L, -2);
+
+    if (lua_type (L, -1) == LUA_TUSERDATA) {
+        f = *(luap_DescribeFunction *)lua_touserdata (L, -1);
+    }
+
+    lua_pop (L, 2);
+
+    return f;
+}
+
+/* Tables nested deeper than the collapse depth are shown as handles,
+ * as in "{...#42}", which can be expanded later on, so that huge
+ * values can be inspected piecemeal.  Handles are kept in a table in
+ * the registry, with weak keys and values, mapping each handle to its
+ * table and back, so that tables are neither kept from being
+ * collected, nor given more than one handle.  The last handle given
+ * out is kept in the same table, under 0, so that each state numbers
+ * its handles on its own. */
+
+static char handles_key;
+
+static void push_handles (lua_State *L)
+{
+    lua_pushlightuserdata (L, &handles_key);
+    lua_rawget (L, LUA_REGISTRYINDEX);
+
+    if (lua_isnil (L, -1)) {
+        lua_pop (L, 1);
+        lua_newtable (L);
+
+        lua_createtable (L, 0, 1);
+        lua_pushliteral (L, "kv");
+        lua_setfield (L, -2, "__mode");
+        lua_setmetatable (L, -2);
+
+        lua_pushlightuserdata (L, &handles_key);
+        lua_pushvalue (L, -2);
+        lua_rawset (L, LUA_REGISTRYINDEX);
+    }
+}
+
+static void dump_handle (luap_Describer *D, lua_State *L, int index)
+{
+    char t[32];
+    int h, m;
+
+    luaL_checkstack (L, 3, NULL);
+
+    push_handles (L);
+    lua_pushvalue (L, index);
+    lua_rawget (L, -2);
+    h = (int)lua_tointeger (L, -1);
+    lua_pop (L, 1);
+
+    if (h == 0) {
+        lua_rawgeti (L, -1, 0);
+        h = (int)lua_tointeger (L, -1) + 1;
+        lua_pop (L, 1);
+
+        lua_pushinteger (L, h);
+        lua_rawseti (L, -2, 0);
+
+        lua_pushvalue (L, index);
+        lua_pushinteger (L, h);
+        lua_rawset (L, -3);
+
+        lua_pushinteger (L, h);
+        lua_pushvalue (L, index);
+        lua_rawset (L, -3);
+    }
+
+    lua_pop (L, 1);
+
+    m = sprintf (t, "#%d", h);
+    dump_fit (D, m + 5);
+    dump_literal (D, "{");
+    dump_color (D, 7);
+    dump_literal (D, "...");
+    dump_text (D, t, m, m);
+    dump_color (D, 8);
+    dump_literal (D, "}");
+}
+
+int luap_expand (lua_State *L, int handle)
+{
+    /* Push the table behind a handle, unless it's been collected. */
+
+    push_handles (L);
+    lua_rawgeti (L, -1, handle);
+    lua_remove (L, -2);
+
+    if (lua_istable (L, -1)) {
+        return 1;
+    }
+
+    lua_pop (L, 1);
+
+    return 0;
+}
+
+static int is_structured (luap_Describer *D, lua_State *L, int index)
+{
+    /* Values with native describers may well be shown as tables, so
+     * place them as such.  Collapsed tables on the other hand are
+     * short enough to fill up lines with. */
+
+    if (lua_istable (L, index)) {
+        return !(D->collapse > 0 && D->level >= D->collapse);
+    }
+
+    return find_describer (L, index) != NULL;
+}
+
+static void mark (luap_Describer *D, lua_State *L, int index, int level)
+{
+    int i, l, shown, seen;
+
+    /* Walk the hierarchy the way describe will, and note each table
+     * in the visited table as seen once (false) or more times
+     * (true).  The contents of each table are only walked the first
+     * time it is seen, so that this takes time linear in the number
+     * of distinct tables. */
+
+    index = absolute (L, index);
+
+    if (lua_type (L, index) != LUA_TTABLE ||
+        (D->max_depth > 0 && level >= D->max_depth) ||
+        (D->collapse > 0 && level >= D->collapse) ||
+        2 * level > 8 * D->columns / 10) {
+        return;
+    }
+
+    luaL_checkstack (L, 4, NULL);
+
+    lua_rawgeti (L, LUA_REGISTRYINDEX, D->visited);
+    lua_pushvalue (L, index);
+    lua_rawget (L, -2);
+    seen = !lua_isnil (L, -1);
+    lua_pop (L, 1);
+
+    lua_pushvalue (L, index);
+    lua_pushboolean (L, seen);
+    lua_rawset (L, -3);
+    lua_pop (L, 1);
+
+    if (seen || find_describer (L, index)) {
+        return;
+    }
+
+    if (luaL_getmetafield (L, index, "__tostring")) {
+        lua_pop (L, 1);
+        return;
+    }
+
+    l = lua_rawlen (L, index);
+
+    for (i = 0 ; i < l && (D->max_entries == 0 || i < D->max_entries) ; i += 1) {
+        lua_rawgeti (L, index, i + 1);
+        mark (D, L, -1, level + 1);
+        lua_pop (L, 1);
+    }
+
+    shown = i;
+
+    lua_pushnil (L);
+    while (lua_next (L, index) != 0) {
+        if (!in_array_part (L, -2, l)) {
+            if (D->max_entries > 0 && shown >= D->max_entries) {
+                lua_pop (L, 2);
+                break;
+            }
+
+            mark (D, L, -2, level + 1);
+            mark (D, L, -1, level + 1);
+            shown += 1;
+        }
+
+        lua_pop (L, 1);
+    }
+}
+
+/* Integer keys outside the array part, such as those of sparse,
+ * ID-indexed tables, are collected while traversing the hash part and
+ * shown in order afterwards.  Runs of consecutive keys are shown as
+ * ranges, as in "[100..199] = 0", if they all map to the same value,
+ * or as in "[100..102] = ( "a", "b", "c" )" otherwise.  The keys are
+ * collected on a stack kept in the describer, so that nested tables
+ * can push theirs on top while their parent's keys are being shown. */
+
+#define RUN_MIN_LENGTH 3
+
+static void describe (luap_Describer *D, lua_State *L, int index);
+
+static int integer_key (lua_State *L, int index, long long *k)
+{
+    lua_Number x;
+
+    /* Check whether the key at the specified index is an integer, and
+     * if so store it in k. */
+
+    if (lua_type (L, index) != LUA_TNUMBER) {
+        return 0;
+    }
+
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger (L, index)) {
+        *k = (long long)lua_tointeger (L, index);
+
+        return 1;
+    }
+#endif
+
+    x = lua_tonumber (L, index);
+
+    if (x < -9007199254740992.0 || x > 9007199254740992.0 ||
+        x != (lua_Number)(long long)x) {
+        return 0;
+    }
+
+    *k = (long long)x;
+
+    return 1;
+}
+
+static void push_key (luap_Describer *D, long long k)
+{
+    if (D->nkeys == D->maxkeys) {
+        D->maxkeys = D->maxkeys > 0 ? 2 * D->maxkeys : 64;
+        D->keys = (long long *)realloc (D->keys,
+                                        D->maxkeys * sizeof (long long));
+    }
+
+    D->keys[D->nkeys] = k;
+    D->nkeys += 1;
+}
+
+static int compare_keys (const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void get_key (luap_Describer *D, lua_State *L, int index, int i)
+{
+    /* Push the value of the i-th collected key. */
+
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger (L, (lua_Integer)D->keys[i]);
+#else
+    lua_pushnumber (L, (lua_Number)D->keys[i]);
+#endif
+
+    lua_rawget (L, index);
+}
+
+static int find_stretch (luap_Describer *D, lua_State *L, int index,
+                         int i, int j)
+{
+    int m;
+
+    /* Find the number of keys, starting with the i-th and ending
+     * before the j-th, that map to the same value. */
+
+    get_key (D, L, index, i);
+
+    for (m = i + 1 ; m < j ; m += 1) {
+        get_key (D, L, index, m);
+
+        if (!lua_rawequal (L, -1, -2)) {
+            lua_pop (L, 1);
+            break;
+        }
+
+        lua_pop (L, 1);
+    }
+
+    lua_pop (L, 1);
+
+    return m - i;
+}
+
+static void dump_key (luap_Describer *D, long long a, long long b)
+{
+    char t[2 * NUMBER_SIZE + 4];
+    int n;
+
+    /* Dump the key of an entry, which is the range [a..b], or just
+     * [a] if b equals a. */
+
+    t[0] = '[';
+    n = 1 + format_integer (t + 1, a);
+
+    if (b != a) {
+        t[n] = '.';
+        t[n + 1] = '.';
+        n += 2 + format_integer (t + n + 2, b);
+    }
+
+    t[n] = ']';
+    n += 1;
+
+    dump_text (D, t, n, n);
+    dump_equals (D);
+}
+
+static int describe_runs (luap_Describer *D, lua_State *L, int index,
+                          int base, int shown, int *stop, int *more)
+{
+    int i, j, m, e, table;
+
+    /* Show the integer keys collected since the base-th, after
+     * having shown the specified number of entries, and return the
+     * number of entries shown in total.  Entries that don't get
+     * shown are added to more. */
+
+    luaL_checkstack (L, 3, NULL);
+    qsort (D->keys + base, D->nkeys - base, sizeof (long long),
+           compare_keys);
+
+    for (i = j = base ; i < D->nkeys ; ) {
+        if (*stop || (*stop = cut_short (D, shown))) {
+            *more += D->nkeys - i;
+            break;
+        }
+
+        if (shown > 0) {
+            dump_literal (D, ",");
+        }
+
+        dump_break (D, 1);
+
+        /* Find the run of consecutive keys the i-th belongs to, if
+         * it's a new one, and the stretch of equal values starting
+         * with it. */
+
+        if (j <= i) {
+            for (j = i + 1 ;
+                 j < D->nkeys && D->keys[j] == D->keys[j - 1] + 1 ;
+                 j += 1);
+        }
+
+        e = j - i > 1 ? find_stretch (D, L, index, i, j) : 1;
+
+        if (e > 1) {
+            dump_key (D, D->keys[i], D->keys[i + e - 1]);
+            get_key (D, L, index, i);
+            describe (D, L, -1);
+            lua_pop (L, 1);
+
+            shown += 1;
+            i += e;
+
+            continue;
+        }
+
+        /* Otherwise extend the list of values up to the next long
+         * enough stretch of equal ones. */
+
+        for (m = i + 1 ; m < j ; m += e) {
+            if ((e = find_stretch (D, L, index, m, j)) >= RUN_MIN_LENGTH) {
+                break;
+            }
+        }
+
+        if (m - i < RUN_MIN_LENGTH) {
+            dump_key (D, D->keys[i], D->keys[i]);
+            get_key (D, L, index, i);
+            describe (D, L, -1);
+            lua_pop (L, 1);
+
+            shown += 1;
+            i += 1;
+
+            continue;
+        }
+
+        dump_key (D, D->keys[i], D->keys[m - 1]);
+        dump_literal (D, "(");
+        open_group (D);
+
+        for (j = i, table = 0 ; j < m ; j += 1) {
+            if (j > i) {
+                dump_literal (D, ",");
+            }
+
+            get_key (D, L, index, j);
+            dump_break (D, table || is_structured (D, L, -1));
+            table = is_structured (D, L, -1);
+
+            describe (D, L, -1);
+            lua_pop (L, 1);
+
+            shown += 1;
+
+            if (j < m - 1 && (*stop = cut_short (D, shown))) {
+                *more += m - j - 1;
+                break;
+            }
+        }
+
+        close_group (D, ')', 0);
+        i = m;
+    }
+
+    return shown;
+}
+
+/* Arrays of records with the same keys, such as lists of connections
+ * or jobs, can be shown in columns instead, that is as a header row
+ * naming the keys, followed by a row per record, listing just the
+ * values.  Whether an array qualifies, as well as the width of each
+ * column, is decided on from a sample of its records.  Any records
+ * that don't match the sample are shown as usual. */
+
+#define COLUMNS_MIN_ROWS 4
+#define COLUMNS_MAX 32
+#define COLUMNS_SAMPLE_SIZE 8
+
+static int is_record (lua_State *L, int index, int keys, int k)
+{
+    int i, n;
+
+    /* Check whether the value at the specified index is a plain
+     * table with exactly the k keys listed in the keys table. */
+
+    index = absolute (L, index);
+
+    if (lua_type (L, index) != LUA_TTABLE || find_describer (L, index)) {
+        return 0;
+    }
+
+    if (luaL_getmetafield (L, index, "__tostring")) {
+        lua_pop (L, 1);
+        return 0;
+    }
+
+    for (i = 1 ; i <= k ; i += 1) {
+        lua_rawgeti (L, keys, i);
+        lua_rawget (L, index);
+
+        if (lua_isnil (L, -1)) {
+            lua_pop (L, 1);
+            return 0;
+        }
+
+        lua_pop (L, 1);
+    }
+
+    n = 0;
+
+    lua_pushnil (L);
+    while (lua_next (L, index) != 0) {
+        lua_pop (L, 1);
+
+        if ((n += 1) > k) {
+            lua_pop (L, 1);
+            return 0;
+        }
+    }
+
+    return n == k;
+}
+
+static int measure (luap_Describer *D, lua_State *L, int index)
+{
+    luap_Writer writer;
+    unsigned long steps;
+    size_t offset, n;
+    int column, indent, spaced, exhausted, l;
+
+    /* Find the printed width of a value, by dumping it as if at the
+     * start of a line, without a writer, and then taking it back.
+     * This is only done after all groups have been decided on, so
+     * that none of them is affected.  The budgets are restored as
+     * well, so that measuring doesn't count against them, unless
+     * we've been interrupted meanwhile.  Only plain scalars qualify,
+     * so that measuring is cheap and has no side effects: tables
+     * could take any amount of room and get handles that would never
+     * be shown, while values with native describers or __tostring
+     * metamethods would have to be described twice.  For these, as
+     * well as for strings longer than the line and values that span
+     * several lines, -1 is returned. */
+
+    index = absolute (L, index);
+
+    if (lua_type (L, index) == LUA_TTABLE || find_describer (L, index)) {
+        return -1;
+    }
+
+    if (luaL_getmetafield (L, index, "__tostring")) {
+        lua_pop (L, 1);
+        return -1;
+    }
+
+    if (lua_type (L, index) == LUA_TSTRING) {
+        lua_tolstring (L, index, &n);
+
+        if (D->max_string > 0 && n > (size_t)D->max_string) {
+            n = D->max_string;
+        }
+
+        if (n > (size_t)D->columns) {
+            return -1;
+        }
+    }
+
+    writer = D->writer;
+    offset = D->offset;
+    column = D->column;
+    indent = D->indent;
+    spaced = D->spaced;
+    steps = D->steps;
+    exhausted = D->exhausted;
+
+    D->writer = NULL;
+    D->column = 0;
+    D->indent = 0;
+    D->spaced = 0;
+
+    describe (D, L, index);
+
+    l = memchr (D->dump + offset, '\n', D->offset - offset) ? -1 : D->column;
+
+    D->writer = writer;
+    D->offset = offset;
+    D->column = column;
+    D->indent = indent;
+    D->spaced = spaced;
+    D->steps = steps;
+    D->exhausted = exhausted || D->interrupted;
+    D->dump[D->offset] = '\0';
+
+    return l;
+}
+
+static int find_columns (luap_Describer *D, lua_State *L, int index, int l,
+                         int *widths)
+{
+    const char *s;
+    size_t n;
+    int i, j, k, m, w, keys;
+
+    /* Check whether the array part, of length l, of the table at the
+     * specified index qualifies to be shown in columns.  If so, push
+     * a table listing the keys and return their number, after
+     * storing the width of each column in widths.  Otherwise return
+     * zero. */
+
+    if (l < COLUMNS_MIN_ROWS || D->references) {
+        return 0;
+    }
+
+    luaL_checkstack (L, 5, NULL);
+    lua_newtable (L);
+    keys = lua_gettop (L);
+
+    /* Take the keys from the first record. */
+
+    k = 0;
+    lua_rawgeti (L, index, 1);
+
+    if (lua_type (L, -1) == LUA_TTABLE) {
+        lua_pushnil (L);
+        while (lua_next (L, -2) != 0) {
+            lua_pop (L, 1);
+
+            if (lua_type (L, -1) != LUA_TSTRING || k == COLUMNS_MAX ||
+                (s = lua_tolstring (L, -1, &n), !is_identifier (s, n))) {
+                lua_pop (L, 1);
+                k = 0;
+                break;
+            }
+
+            widths[k] = n;
+            k += 1;
+
+            lua_pushvalue (L, -1);
+            lua_rawseti (L, keys, k);
+        }
+    }
+
+    lua_pop (L, 1);
+
+    /* Check that a sample of records, spread evenly over the array,
+     * have the same keys. */
+
+    for (j = 0 ; k > 0 && j < COLUMNS_SAMPLE_SIZE && j < l ; j += 1) {
+        i = l <= COLUMNS_SAMPLE_SIZE ? j : j * (l - 1) / (COLUMNS_SAMPLE_SIZE - 1);
+
+        lua_rawgeti (L, index, i + 1);
+
+        if (!is_record (L, -1, keys, k)) {
+            k = 0;
+        }
+
+        lua_pop (L, 1);
+    }
+
+    if (k == 0) {
+        lua_pop (L, 1);
+        return 0;
+    }
+
+    /* The table is to be shown on several lines in any case now, so
+     * decide on all groups and then find the width of each column,
+     * making sure that the rows will fit on the line. */
+
+    settle_groups (D);
+
+    for (j = 0 ; j < COLUMNS_SAMPLE_SIZE && j < l ; j += 1) {
+        i = l <= COLUMNS_SAMPLE_SIZE ? j : j * (l - 1) / (COLUMNS_SAMPLE_SIZE - 1);
+
+        lua_rawgeti (L, index, i + 1);
+
+        for (w = 0 ; w < k ; w += 1) {
+            lua_rawgeti (L, keys, w + 1);
+            lua_rawget (L, -2);
+            m = measure (D, L, -1);
+            lua_pop (L, 1);
+
+            if (m < 0) {
+                lua_pop (L, 2);
+                return 0;
+            }
+
+            if (m > widths[w]) {
+                widths[w] = m;
+            }
+        }
+
+        lua_pop (L, 1);
+    }
+
+    for (j = 0, w = D->indent + 5 ; j < k ; j += 1) {
+        w += widths[j] + 2;
+    }
+
+    if (w > D->columns) {
+        lua_pop (L, 1);
+        return 0;
+    }
+
+    return k;
+}
+
+static void dump_padding (luap_Describer *D, int n)
+{
+    /* Dump n spaces, or at least one. */
+
+    if (n < 1) {
+        n = 1;
+    }
+
+    check_fit (D, n);
+    memset (D->dump + D->offset, ' ', n);
+
+    D->offset += n;
+    D->column += n;
+}
+
+static int describe_columns (luap_Describer *D, lua_State *L, int index,
+                             int l, int *stop)
+{
+    const char *s;
+    size_t n;
+    int widths[COLUMNS_MAX], keys, i, j, k, c;
+
+    /* Show the array part, of length l, of the table at the specified
+     * index in columns, if it qualifies, and return the number of
+     * entries shown.  Otherwise return -1, without having dumped
+     * anything. */
+
+    if (!(k = find_columns (D, L, index, l, widths))) {
+        return -1;
+    }
+
+    keys = lua_gettop (L);
+
+    /* Dump the header. */
+
+    dump_break (D, 1);
+    dump_literal (D, "[ ");
+
+    for (j = 0 ; j < k ; j += 1) {
+        lua_rawgeti (L, keys, j + 1);
+        s = lua_tolstring (L, -1, &n);
+        c = D->column;
+
+        dump_color (D, 7);
+        dump_raw (D, s, n, n);
+        dump_color (D, 8);
+        lua_pop (L, 1);
+
+        if (j < k - 1) {
+            dump_literal (D, ",");
+            dump_padding (D, c + widths[j] + 2 - D->column);
+        }
+    }
+
+    dump_literal (D, " ]");
+
+    /* And a row per record, each on a line of its own. */
+
+    for (i = 0 ; i < l && !(*stop = cut_short (D, i)) ; i += 1) {
+        lua_rawgeti (L, index, i + 1);
+        dump_literal (D, ",");
+        dump_break (D, 1);
+
+        if (!is_record (L, -1, keys, k)) {
+            describe (D, L, -1);
+            lua_pop (L, 1);
+
+            continue;
+        }
+
+        D->steps += 1;
+        dump_literal (D, "{ ");
+
+        for (j = 0 ; j < k ; j += 1) {
+            lua_rawgeti (L, keys, j + 1);
+            lua_rawget (L, -2);
+            c = D->column;
+
+            describe (D, L, -1);
+            lua_pop (L, 1);
+
+            if (j < k - 1) {
+                dump_literal (D, ",");
+                dump_padding (D, c + widths[j] + 2 - D->column);
+            }
+        }
+
+        dump_literal (D, " }");
+        lua_pop (L, 1);
+    }
+
+    lua_pop (L, 1);
+
+    return i;
+}
+
+static void describe (luap_Describer *D, lua_State *L, int index)
+{
+    luap_DescribeFunction f;
+    char *s;
+    size_t n;
+    int type;
+
+    index = absolute (L, index);
+    type = lua_type (L, index);
+    D->steps += 1;
+
+    if ((f = find_describer (L, index))) {
+        f (D, L, index);
+    } else if (luaL_getmetafield (L, index, "__tostring")) {
+        lua_pushvalue (L, index);
+        lua_pcall (L, 1, 1, 0);
+        s = (char *)lua_tolstring (L, -1, &n);
+        lua_pop (L, 1);
+
+        dump_string (D, s, n);
+    } else if (type == LUA_TNUMBER) {
+        char t[NUMBER_SIZE];
+
+        n = format_number (D, L, index, t);
+        dump_text (D, t, n, n);
+    } else if (type == LUA_TSTRING) {
+        s = (char *)lua_tolstring (L, index, &n);
+
+        if (D->max_string > 0 && n > (size_t)D->max_string) {
+            size_t h, k;
+
+            /* Only show the head and tail of long strings.  Avoid
+             * splitting UTF-8 sequences in the process. */
+
+            h = D->max_string / 2;
+            k = D->max_string - h;
+
+            while (h > 0 && (s[h] & 0xc0) == 0x80) {
+                h -= 1;
+            }
+
+            while (k > 0 && (s[n - k] & 0xc0) == 0x80) {
+                k -= 1;
+            }
+
+            describe_string (D, s, h);
+            dump_literal (D, " ");
+            dump_elision (D, n - h - k, "bytes");
+            dump_literal (D, " ");
+            describe_string (D, s + n - k, k);
+        } else {
+            describe_string (D, s, n);
+        }
+    } else if (type == LUA_TNIL) {
+        dump_keyword (D, "nil", 3);
+    } else if (type == LUA_TBOOLEAN) {
+        if (lua_toboolean (L, index)) {
+            dump_keyword (D, "true", 4);
+        } else {
+            dump_keyword (D, "false", 5);
+        }
+    } else if (type == LUA_TFUNCTION) {
+        dump_opaque (D, "function:", 9, lua_topointer (L, index));
+    } else if (type == LUA_TUSERDATA) {
+        dump_opaque (D, "userdata:", 9, lua_topointer (L, index));
+    } else if (type == LUA_TTHREAD) {
+        dump_opaque (D, "thread:", 7, lua_topointer (L, index));
+    } else if (type == LUA_TTABLE) {
+        int i, l, shown, more, stop, multiline, table, raw, base;
+        long long k;
+
+        /* Check if table is too deeply nested.  Undecided groups may
+         * have pushed it too far to the right, so break them up
+         * first, to make room. */
+
+        while (D->indent > 8 * D->columns / 10 && D->pending < D->ngroups) {
+            break_group (D);
+        }
+
+        if (D->indent > 8 * D->columns / 10 ||
+            (D->max_depth > 0 && D->level >= D->max_depth)) {
+            dump_fit (D, 7);
+            dump_literal (D, "{ ");
+            dump_color (D, 7);
+            dump_literal (D, "...");
+            dump_color (D, 8);
+            dump_literal (D, " }");
+
+            return;
+        }
+
+        /* Collapse non-empty tables beyond the collapse depth. */
+
+        if (D->collapse > 0 && D->level >= D->collapse) {
+            lua_pushnil (L);
+
+            if (lua_next (L, index) != 0) {
+                lua_pop (L, 2);
+                dump_handle (D, L, index);
+
+                return;
+            }
+        }
+
+        /* If the table has been shown already, refer to it by its
+         * label.  Otherwise, if it's going to be shown again, label
+         * it. */
+
+        if (D->references) {
+            char t[32];
+            int m;
+
+            lua_rawgeti (L, LUA_REGISTRYINDEX, D->visited);
+            lua_pushvalue (L, index);
+            lua_rawget (L, -2);
+
+            if (lua_type (L, -1) == LUA_TNUMBER) {
+                m = sprintf (t, "<ref #%d>", (int)lua_tointeger (L, -1));
+
+                dump_fit (D, m);
+                dump_color (D, 7);
+                dump_raw (D, t, m, m);
+                dump_color (D, 8);
+                lua_pop (L, 2);
+
+                return;
+            } else if (lua_toboolean (L, -1)) {
+                D->labels += 1;
+
+                lua_pushvalue (L, index);
+                lua_pushinteger (L, D->labels);
+                lua_rawset (L, -4);
+
+                m = sprintf (t, "<#%d> ", D->labels);
+
+                dump_fit (D, m);
+                dump_color (D, 7);
+                dump_raw (D, t, m, m);
+                dump_color (D, 8);
+            }
+
+            lua_pop (L, 2);
+        }
+
+        /* Check if the table introduces a cycle by checking whether
+         * it is a back-edge (that is, one of its own ancestors).  The
+         * ancestors are keyed by the tables themselves, so that the
+         * lookup is a raw, identity-based hash lookup, which doesn't
+         * invoke any metamethods. */
+
+        lua_rawgeti (L, LUA_REGISTRYINDEX, D->ancestors);
+        lua_pushvalue (L, index);
+        lua_rawget (L, -2);
+
+        if (!lua_isnil (L, -1)) {
+            char t[NUMBER_SIZE];
+            int n;
+
+            n = format_integer (t, (long long)lua_tointeger (L, -1) -
+                                D->level - 1);
+
+            dump_fit (D, n + 9);
+            dump_literal (D, "{ ");
+            dump_color (D, 7);
+            dump_literal (D, "[");
+            dump_raw (D, t, n, n);
+            dump_literal (D, "]...");
+            dump_color (D, 8);
+            dump_literal (D, " }");
+            lua_pop (L, 2);
+
+            return;
+        }
+
+        lua_pop (L, 1);
+
+        /* Add the table to the ancestor set, along with its depth,
+         * and pop the ancestor set table. */
+
+        D->level += 1;
+
+        lua_pushvalue (L, index);
+        lua_pushinteger (L, D->level);
+        lua_rawset (L, -3);
+        lua_pop (L, 1);
+
+        /* Open the table as a new group. */
+
+        dump_literal (D, "{");
+        open_group (D);
+        multiline = 0;
+        table = 0;
+
+        l = lua_rawlen (L, index);
+        stop = 0;
+
+        /* Read the array part with raw accesses, unless asked to go
+         * through the __index metamethod.  For tables that don't
+         * have one, this makes no difference, so raw accesses are
+         * always used. */
+
+        raw = D->raw;
+
+        if (!raw) {
+            if (luaL_getmetafield (L, index, "__index")) {
+                lua_pop (L, 1);
+            } else {
+                raw = 1;
+            }
+        }
+
+        /* Traverse the array part first, in columns if asked to and
+         * if it qualifies. */
+
+        if (D->columnar && raw &&
+            (i = describe_columns (D, L, index, l, &stop)) >= 0) {
+            multiline = 1;
+        } else {
+            for (i = 0 ; i < l && !(stop = cut_short (D, i)) ; i += 1) {
+                if (raw) {
+                    lua_rawgeti (L, index, i + 1);
+                } else {
+                    lua_pushinteger (L, i + 1);
+                    lua_gettable (L, index);
+                }
+
+                /* Dump the separating comma and the value.  Should the
+                 * table be broken up, tables are placed on lines of their
+                 * own, to make sure there's plenty of room, while other
+                 * values fill up the lines. */
+
+                if (i > 0) {
+                    dump_literal (D, ",");
+                }
+
+                dump_break (D, table || is_structured (D, L, -1));
+                table = is_structured (D, L, -1);
+                multiline = multiline || table;
+
+                describe (D, L, -1);
+                lua_pop (L, 1);
+            }
+        }
+
+        /* Now for the hash part.  If we've stopped showing entries,
+         * just count the remaining ones, unless we've stopped
+         * altogether. */
+
+        shown = i;
+        more = l - i;
+
+        base = D->nkeys;
+
+        lua_pushnil (L);
+        while (lua_next (L, index) != 0) {
+            if (integer_key (L, -2, &k)) {
+                if (k < 1 || k > l) {
+                    push_key (D, k);
+                }
+            } else {
+                if (stop || (stop = cut_short (D, shown))) {
+                    if (D->status != 0 || D->exhausted) {
+                        lua_pop (L, 2);
+                        break;
+                    }
+
+                    more += 1;
+                    lua_pop (L, 1);
+
+                    continue;
+                }
+
+                /* Keep each key-value pair on a separate line, should
+                 * the table be broken up. */
+
+                if (shown > 0) {
+                    dump_literal (D, ",");
+                }
+
+                dump_break (D, 1);
+                multiline = 1;
+                shown += 1;
+
+                /* Dump the key and value. */
+
+                if (lua_type (L, -2) == LUA_TSTRING) {
+                    char *s;
+                    size_t n;
+
+                    s = (char *)lua_tolstring (L, -2, &n);
+
+                    if(is_identifier (s, n)) {
+                        dump_color (D, 7);
+                        dump_string (D, s, n);
+                        dump_color (D, 8);
+                    } else {
+                        dump_literal (D, "[");
+                        describe (D, L, -2);
+                        dump_literal (D, "]");
+                    }
+                } else {
+                    dump_literal (D, "[");
+                    describe (D, L, -2);
+                    dump_literal (D, "]");
+                }
+
+                dump_equals (D);
+                describe (D, L, -1);
+            }
+
+            lua_pop (L, 1);
+        }
+
+        /* Then for the integer keys outside the array part. */
+
+        if (D->nkeys > base) {
+            shown = describe_runs (D, L, index, base, shown, &stop, &more);
+            multiline = 1;
+            D->nkeys = base;
+        }
+
+        /* Make a note of any entries left out. */
+
+        if (stop) {
+            if (shown > 0) {
+                dump_literal (D, ",");
+            }
+
+            dump_break (D, multiline);
+            dump_elision (D, D->status != 0 || D->exhausted ? 0 : more, "more");
+        }
+
+        /* Remove the table from the ancestor set. */
+
+        lua_rawgeti (L, LUA_REGISTRYINDEX, D->ancestors);
+        lua_pushvalue (L, index);
+        lua_pushnil (L);
+        lua_rawset (L, -3);
+        lua_pop (L, 1);
+
+        D->level -= 1;
+
+        /* Close the table. */
+
+        close_group (D, '}', !stop);
+    }
+}
+
+static void describe_value (luap_Describer *D, lua_State *L, int index)
+{
+#ifdef HAVE_IOCTL
+    struct winsize w;
+#endif
+
+    /* Initialize the state. */
+
+    if (D->linewidth > 0) {
+        D->columns = D->linewidth;
+    } else {
+#ifdef HAVE_IOCTL
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) < 0) {
+            D->columns = 80;
+        } else {
+            D->columns = w.ws_col;
+        }
+#else
+        D->columns = 80;
+#endif
+    }
+
+    index = absolute (L, index);
+    trim_dump (D);
+    D->offset = 0;
+    D->flushed = 0;
+    D->indent = 0;
+    D->column = 0;
+    D->spaced = 0;
+    D->status = 0;
+    D->exhausted = 0;
+    D->interrupted = 0;
+    D->steps = 0;
+    D->ngroups = 0;
+    D->nbreaks = 0;
+    D->pending = 0;
+    D->nkeys = 0;
+
+    /* Create a table to hold the ancestors for checking for cycles
+     * when printing table hierarchies. */
+
+    D->level = 0;
+    lua_newtable (L);
+    D->ancestors = luaL_ref (L, LUA_REGISTRYINDEX);
+
+    /* Find out which tables are shared, if needed. */
+
+    if (D->references) {
+        D->labels = 0;
+        lua_newtable (L);
+        D->visited = luaL_ref (L, LUA_REGISTRYINDEX);
+
+        mark (D, L, index, 0);
+    }
+
+    describe (D, L, index);
+
+    /* Make it clear that the print-out is incomplete, if we've been
+     * interrupted. */
+
+    if (D->interrupted) {
+        dump_literal (D, " ");
+        dump_color (D, 7);
+        dump_literal (D, "<interrupted>");
+        dump_color (D, 8);
+    }
+
+    if (D->references) {
+        luaL_unref (L, LUA_REGISTRYINDEX, D->visited);
+    }
+
+    luaL_unref (L, LUA_REGISTRYINDEX, D->ancestors);
+}
+
+void luap_initdescriber (luap_Describer *D)
+{
+    /* Start out with the options of the default describer. */
+
+    memset (D, 0, sizeof (luap_Describer));
+
+    D->linewidth = describer.linewidth;
+    D->colorize = describer.colorize;
+    D->references = describer.references;
+    D->roundtrip = describer.roundtrip;
+    D->raw = describer.raw;
+    D->columnar = describer.columnar;
+    D->collapse = describer.collapse;
+    D->max_entries = describer.max_entries;
+    D->max_depth = describer.max_depth;
+    D->max_string = describer.max_string;
+    D->max_total = describer.max_total;
+    D->max_steps = describer.max_steps;
+    D->interrupt = describer.interrupt;
+}
+
+void luap_cleardescriber (luap_Describer *D)
+{
+    free (D->dump);
+    free (D->groups);
+    free (D->breaks);
+    free (D->keys);
+
+    D->dump = NULL;
+    D->length = 0;
+    D->groups = NULL;
+    D->maxgroups = 0;
+    D->breaks = NULL;
+    D->maxbreaks = 0;
+    D->keys = NULL;
+    D->maxkeys = 0;
+}
 
-        if (ar.istailcall) {
-            lua_pushfstring(L, "\t... tail calls\n");
-        }
-#endif
+/* Describing a value can run Lua code, such as __index metamethods
+ * or native describers, which can raise errors, or be interrupted
+ * via the hook above.  The traversal is therefore run in protected
+ * mode, so that errors never escape into the host.  If it's cut
+ * short, the describer is reset, so that it's ready for the next
+ * value, and the description is marked as incomplete. */
 
-        if (!strcmp (ar.what, "C")) {
-            lua_pushfstring(L, "\t#%d %s[C]:%s in function ",
-                            i, COLOR(7), COLOR(8));
+static int describe_protected (lua_State *L)
+{
+    describe_value ((luap_Describer *)lua_touserdata (L, 1), L, 2);
 
-            if (ar.name) {
-                lua_pushfstring(L, "'%s%s%s'\n",
-                                COLOR(7), ar.name, COLOR(8));
-            } else {
-                lua_pushfstring(L, "%s?%s\n", COLOR(7), COLOR(8));
-            }
-        } else if (!strcmp (ar.what, "main")) {
-            lua_pushfstring(L, "\t#%d %s%s:%d:%s in the main chunk\n",
-                            i, COLOR(7), ar.short_src, ar.currentline,
-                            COLOR(8));
-        } else if (!strcmp (ar.what, "Lua")) {
-            lua_pushfstring(L, "\t#%d %s%s:%d:%s in function ",
-                            i, COLOR(7), ar.short_src, ar.currentline,
-                            COLOR(8));
+    return 0;
+}
 
-            if (ar.name) {
-                lua_pushfstring(L, "'%s%s%s'\n",
-                                COLOR(7), ar.name, COLOR(8));
-            } else {
-                lua_pushfstring(L, "%s?%s\n", COLOR(7), COLOR(8));
+static void reset_describer (luap_Describer *D, lua_State *L)
+{
+    /* Release the tables of a traversal cut short and forget about
+     * any groups left open.  The breaks of undecided groups simply
+     * remain spaces. */
+
+    luaL_unref (L, LUA_REGISTRYINDEX, D->ancestors);
+    luaL_unref (L, LUA_REGISTRYINDEX, D->visited);
+
+    D->ancestors = LUA_NOREF;
+    D->visited = LUA_NOREF;
+    D->level = 0;
+    D->indent = 0;
+    D->ngroups = 0;
+    D->nbreaks = 0;
+    D->pending = 0;
+    D->nkeys = 0;
+}
+
+static void describe_safely (luap_Describer *D, lua_State *L, int index)
+{
+    const char *s;
+    size_t n;
+
+    index = absolute (L, index);
+
+    D->busy = 1;
+    D->ancestors = LUA_NOREF;
+    D->visited = LUA_NOREF;
+
+    lua_pushcfunction (L, describe_protected);
+    lua_pushlightuserdata (L, D);
+    lua_pushvalue (L, index);
+
+    if (lua_pcall (L, 2, 0, 0) != LUA_OK) {
+        reset_describer (D, L);
+
+        dump_literal (D, " ");
+        dump_color (D, 7);
+
+        if (D->interrupt && *D->interrupt) {
+            dump_literal (D, "<interrupted>");
+        } else {
+            if (!(s = lua_tolstring (L, -1, &n))) {
+                s = "(error object is not a string)";
+                n = strlen (s);
             }
+
+            dump_literal (D, "<error: ");
+            dump_raw (D, s, n, width (s, n));
+            dump_literal (D, ">");
         }
+
+        dump_color (D, 8);
+        lua_pop (L, 1);
     }
 
-    if (i == 0) {
-        lua_pushstring (L, "No activation records.\n");
+    D->busy = 0;
+}
+
+int luap_describe_ex (luap_Describer *D, lua_State *L, int index,
+                      luap_Writer w, void *ud)
+{
+    D->writer = w;
+    D->writer_data = ud;
+
+    describe_safely (D, L, index);
+    flush_dump (D);
+
+    D->writer = NULL;
+
+    return D->status;
+}
+
+/* These are for use by native describers.  Text is dumped as is,
+ * while structured values are dumped as a table, opened and closed
+ * around a sequence of fields, each of which is either a key-value
+ * pair, or a positional value if the key is NULL.  Field values are
+ * described like any other value. */
+
+void luap_describer_text (luap_Describer *D, const char *s, size_t n)
+{
+    dump_string (D, s, n);
+}
+
+void luap_describer_open (luap_Describer *D)
+{
+    dump_literal (D, "{");
+    open_group (D);
+    D->level += 1;
+}
+
+void luap_describer_field (luap_Describer *D, lua_State *L, const char *key,
+                           int index)
+{
+    struct luap_Group *g;
+
+    index = absolute (L, index);
+    g = &D->groups[D->ngroups - 1];
+
+    if (g->entries > 0) {
+        dump_literal (D, ",");
     }
 
-    lua_concat (L, lua_gettop(L));
+    g->entries += 1;
 
-    return 1;
+    if (key) {
+        dump_break (D, 1);
+        dump_color (D, 7);
+        dump_string (D, key, strlen (key));
+        dump_color (D, 8);
+        dump_equals (D);
+    } else {
+        dump_break (D, is_structured (D, L, index));
+    }
+
+    describe (D, L, index);
 }
 
-static int execute ()
+void luap_describer_close (luap_Describer *D)
 {
-    int i, h_0, h, status;
+    D->level -= 1;
+    close_group (D, '}', D->groups[D->ngroups - 1].entries > 0);
+}
 
-#ifdef SAVE_RESULTS
-    /* Get the results table, and stash it behind the to-be-executed
-     * chunk. */
+char *luap_describe (lua_State *L, int index)
+{
+    static char *nested;
+    luap_Describer d;
 
-    lua_rawgeti(M, LUA_REGISTRYINDEX, results);
-    lua_insert(M, -2);
-#endif
+    if (!describer.busy) {
+        describe_safely (&describer, L, index);
 
-    h_0 = lua_gettop(M);
-    status = luap_call (M, 0);
-    h = lua_gettop (M) - h_0 + 1;
+        return describer.dump;
+    }
 
-    for (i = h ; i > 0 ; i -= 1) {
-        const char *result;
+    /* We've been called while describing some other value, say from
+     * a __tostring metamethod, so use a describer of our own.  Its
+     * buffer is kept until the next such call. */
 
-        result = luap_describe (M, -i);
+    free (nested);
 
-#ifdef SAVE_RESULTS
-        lua_pushvalue (M, -i);
-        lua_rawseti(M, h_0 - 1, (results_n += 1));
+    luap_initdescriber (&d);
+    describe_safely (&d, L, index);
+    nested = d.dump;
 
-        print_output ("%s%s[%d]%s = %s%s\n",
-                      COLOR(4), RESULTS_TABLE_NAME, results_n,
-                      COLOR(3), result, COLOR(0));
-#else
-        if (h == 1) {
-            print_output ("%s%s%s\n", COLOR(3), result, COLOR(0));
-        } else {
-            print_output ("%s%d%s: %s%s\n", COLOR(4), h - i + 1,
-                          COLOR(3), result, COLOR(0));
+    d.dump = NULL;
+    luap_cleardescriber (&d);
+
+    return nested;
+}
+
+int luap_describe_to (lua_State *L, int index, luap_Writer w, void *ud)
+{
+    luap_Describer d;
+    int status;
+
+    if (!describer.busy) {
+        return luap_describe_ex (&describer, L, index, w, ud);
+    }
+
+    luap_initdescriber (&d);
+    status = luap_describe_ex (&d, L, index, w, ud);
+    luap_cleardescriber (&d);
+
+    return status;
+}
+
+/* These are some predefined writers for use with luap_describe_to. */
+
+int luap_filewriter (const char *s, size_t n, void *ud)
+{
+    return fwrite (s, sizeof (char), n, (FILE *)ud) != n;
+}
+
+int luap_fdwriter (const char *s, size_t n, void *ud)
+{
+    ssize_t m;
+
+    /* Write the whole chunk, retrying on short writes. */
+
+    while (n > 0) {
+        m = write (*(int *)ud, s, n);
+
+        if (m < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return 1;
         }
-#endif
+
+        s += m;
+        n -= m;
     }
 
-    /* Clean up.  We need to remove the results table as well if we
-     * track results. */
+    return 0;
+}
 
-#ifdef SAVE_RESULTS
-    lua_settop (M, h_0 - 2);
+int luap_bufferwriter (const char *s, size_t n, void *ud)
+{
+    luaL_addlstring ((luaL_Buffer *)ud, s, n);
+
+    return 0;
+}
+
+/* These are the machine-readable emitters.  They share the traversal
+ * below, which walks the array part of each table and then its hash
+ * part, much like describe, but leaves the actual encoding to a set
+ * of callbacks.  Unlike the print-outs these are meant to be loaded
+ * back, so cycles, or values which cannot be encoded, are errors. */
+
+#define DUMP_MAX_LEVEL 1000
+
+typedef struct {
+    const char *name;
+
+    /* Encode a scalar value (that is, anything but a table). */
+
+    void (*value) (luap_Describer *D, lua_State *L, int index);
+
+    /* Open a table with n entries.  Tables are encoded as arrays if
+     * their keys are exactly 1 to n, and as maps otherwise. */
+
+    void (*open) (luap_Describer *D, int array, size_t n);
+    void (*close) (luap_Describer *D, int array, size_t n);
+
+    /* Encode the key at index, of the i-th entry of the table at
+     * the given index.  Positional keys are the ones leading up to
+     * the first missing integer key. */
+
+    void (*key) (luap_Describer *D, lua_State *L, int table, int index,
+                 size_t i, int array, int positional);
+} emitter;
+
+static void fail (luap_Describer *D, const char *error, const char *culprit)
+{
+    /* Keep the first error only. */
+
+    if (!D->error) {
+        D->error = error;
+        D->culprit = culprit;
+    }
+}
+
+static void dump_bytes (luap_Describer *D, const char *s, size_t n)
+{
+    if (n > 0) {
+        dump_raw (D, s, n, 0);
+    }
+}
+
+static void dump_decimal (luap_Describer *D, unsigned long long n, int k)
+{
+    char t[24], *c;
+
+    /* Format an unsigned integer with at least k digits. */
+
+    c = t + sizeof (t);
+
+    do {
+        *--c = '0' + n % 10;
+        n /= 10;
+        k -= 1;
+    } while (n > 0 || k > 0);
+
+    dump_bytes (D, c, t + sizeof (t) - c);
+}
+
+static int dump_as_integer (lua_State *L, int index, long long *n)
+{
+    /* Check whether a number should be encoded as an integer.  Before
+     * 5.3 there are no integers as such, so integral values that can
+     * be represented as such are treated as integers. */
+
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger (L, index)) {
+        *n = (long long)lua_tointeger (L, index);
+
+        return 1;
+    }
 #else
-    lua_settop (M, h_0 - 1);
+    lua_Number x;
+
+    x = lua_tonumber (L, index);
+
+    if (x >= -9223372036854775808.0 && x < 9223372036854775808.0 &&
+        x == (lua_Number)(long long)x) {
+        *n = (long long)x;
+
+        return 1;
+    }
 #endif
 
-    return status;
+    return 0;
 }
 
-/* This is the pretty-printing related stuff. */
+static void dump_integer (luap_Describer *D, long long n)
+{
+    if (n < 0) {
+        dump_literal (D, "-");
+        dump_decimal (D, -(unsigned long long)n, 1);
+    } else {
+        dump_decimal (D, n, 1);
+    }
+}
 
-static char *dump;
-static int length, offset, indent, column, linewidth, ancestors;
+static int dump_float (luap_Describer *D, double x)
+{
+    char t[NUMBER_SIZE];
+    int m;
+
+    /* Use the shortest representation that reads back as the same
+     * number.  Return whether the result looks like an integer. */
+
+    m = format_float (t, x, 1);
+
+    dump_bytes (D, t, m);
 
-#define dump_literal(s) (check_fit(sizeof(s) - 1), \
-                         strcpy (dump + offset, s), \
-                         offset += sizeof(s) - 1, \
-                         column += width(s))
+    return strspn (t, "-0123456789") == (size_t)m;
+}
+
+static const char *digits = "0123456789abcdef";
 
-#define dump_character(c) (check_fit(1), \
-                           dump[offset] = c, \
-                           offset += 1, \
-                           column += 1)
+/* The JSON emitter. */
 
-static int width (const char *s)
+static size_t utf8_sequence (const unsigned char *s, size_t n)
 {
-    const char *c;
-    int n, discard = 0;
+    unsigned int c;
+    size_t i, k;
+
+    /* Return the length of the UTF-8 sequence at the start of s, or
+     * zero if there's no valid one there.  Overlong sequences,
+     * surrogates and code points past U+10FFFF are invalid. */
+
+    c = s[0];
 
-    /* Calculate the printed width of the chunk s ignoring escape
-     * sequences. */
+    if (c >= 0xc2 && c < 0xe0) {
+        k = 2;
+    } else if (c >= 0xe0 && c < 0xf0) {
+        k = 3;
+    } else if (c >= 0xf0 && c < 0xf5) {
+        k = 4;
+    } else {
+        return 0;
+    }
+
+    if (k > n) {
+        return 0;
+    }
 
-    for (c = s, n = 0 ; *c ; c += 1) {
-        if (!discard && *c == '\033') {
-            discard = 1;
+    for (i = 1, c &= 0x7f >> k ; i < k ; i += 1) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
         }
 
-        if (!discard) {
-            n+= 1;
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+
+    if ((k == 3 && (c < 0x800 || (c >= 0xd800 && c < 0xe000))) ||
+        (k == 4 && (c < 0x10000 || c > 0x10ffff))) {
+        return 0;
+    }
+
+    return k;
+}
+
+static void json_string (luap_Describer *D, const char *s, size_t n)
+{
+    size_t i, m;
+
+    dump_literal (D, "\"");
+
+    for (i = 0 ; i < n ; i += 1) {
+        unsigned char c;
+
+        /* Copy runs of plain characters as is. */
+
+        m = plain_span (s + i, n - i, '"', '\\');
+        dump_bytes (D, s + i, m);
+        i += m;
+
+        if (i == n) {
+            break;
         }
 
-        if (discard && *c == 'm') {
-            discard = 0;
+        c = s[i];
+
+        if (c == '"' || c == '\\') {
+            dump_literal (D, "\\");
+            dump_character (D, c);
+        } else if (c == '\b') {
+            dump_literal (D, "\\b");
+        } else if (c == '\f') {
+            dump_literal (D, "\\f");
+        } else if (c == '\n') {
+            dump_literal (D, "\\n");
+        } else if (c == '\r') {
+            dump_literal (D, "\\r");
+        } else if (c == '\t') {
+            dump_literal (D, "\\t");
+        } else if (c < 0x20) {
+            dump_literal (D, "\\u00");
+            dump_character (D, digits[c >> 4]);
+            dump_character (D, digits[c & 15]);
+        } else if (c < 0x80) {
+            dump_character (D, c);
+        } else if ((m = utf8_sequence ((const unsigned char *)s + i,
+                                       n - i)) > 0) {
+            /* Valid UTF-8 sequences are passed through. */
+
+            dump_bytes (D, s + i, m);
+            i += m - 1;
+        } else {
+            fail (D, "cannot dump strings that aren't valid UTF-8 as JSON",
+                  NULL);
+            break;
         }
     }
 
-    return n;
+    dump_literal (D, "\"");
 }
 
-static void check_fit (int size)
+static int json_format_number (luap_Describer *D, lua_State *L, int index,
+                               char *t)
 {
-    /* Check if a chunk fits in the buffer and expand as necessary. */
+    lua_Number x;
+    long long n;
+
+    /* Format a number into t and return its length, or -1 if it
+     * can't be represented in JSON. */
+
+    if (dump_as_integer (L, index, &n)) {
+        return format_integer (t, n);
+    }
+
+    x = lua_tonumber (L, index);
 
-    if (offset + size + 1 > length) {
-        length = offset + size + 1;
-        dump = (char *)realloc (dump, length * sizeof (char));
+    if (x != x || x - x != 0) {
+        fail (D, "cannot dump non-finite numbers as JSON", NULL);
+
+        return -1;
     }
+
+    return format_float (t, x, 1);
 }
 
-static int is_identifier (const char *s, int n)
+static void json_number (luap_Describer *D, lua_State *L, int index)
 {
-    int i;
+    char t[NUMBER_SIZE];
+    int m;
 
-    /* Check whether a string can be used as a key without quotes and
-     * braces. */
+    if ((m = json_format_number (D, L, index, t)) >= 0) {
+        dump_bytes (D, t, m);
+    }
+}
 
-    for (i = 0 ; i < n ; i += 1) {
-        if (!isalpha(s[i]) &&
-            (i == 0 || !isalnum(s[i])) &&
-            s[i] != '_') {
-            return 0;
+static void json_value (luap_Describer *D, lua_State *L, int index)
+{
+    const char *s;
+    size_t n;
+
+    switch (lua_type (L, index)) {
+    case LUA_TNIL:
+        dump_literal (D, "null");
+        break;
+    case LUA_TBOOLEAN:
+        if (lua_toboolean (L, index)) {
+            dump_literal (D, "true");
+        } else {
+            dump_literal (D, "false");
+        }
+        break;
+    case LUA_TNUMBER:
+        json_number (D, L, index);
+        break;
+    case LUA_TSTRING:
+        s = lua_tolstring (L, index, &n);
+        json_string (D, s, n);
+        break;
+    default:
+        fail (D, "cannot dump %s values", luaL_typename (L, index));
+    }
+}
+
+static void json_open (luap_Describer *D, int array, size_t n)
+{
+    if (array) {
+        dump_literal (D, "[");
+    } else {
+        dump_literal (D, "{");
+    }
+}
+
+static void json_close (luap_Describer *D, int array, size_t n)
+{
+    if (array) {
+        dump_literal (D, "]");
+    } else {
+        dump_literal (D, "}");
+    }
+}
+
+static void json_key (luap_Describer *D, lua_State *L, int table, int index,
+                      size_t i, int array, int positional)
+{
+    char t[NUMBER_SIZE];
+    int m;
+
+    if (i > 0) {
+        dump_literal (D, ",");
+    }
+
+    if (array) {
+        return;
+    }
+
+    /* Object keys must be strings, so numeric keys are quoted, as
+     * long as that doesn't make them clash with a string key. */
+
+    if (lua_type (L, index) == LUA_TSTRING) {
+        json_value (D, L, index);
+    } else if (lua_type (L, index) == LUA_TNUMBER) {
+        if ((m = json_format_number (D, L, index, t)) < 0) {
+            return;
+        }
+
+        lua_pushlstring (L, t, m);
+        lua_rawget (L, table);
+
+        if (!lua_isnil (L, -1)) {
+            fail (D, "cannot dump tables with clashing number and string "
+                  "keys as JSON", NULL);
+        }
+
+        lua_pop (L, 1);
+
+        dump_literal (D, "\"");
+        dump_bytes (D, t, m);
+        dump_literal (D, "\"");
+    } else {
+        fail (D, "cannot dump %s keys as JSON", luaL_typename (L, index));
+    }
+
+    dump_literal (D, ":");
+}
+
+/* The Lua emitter.  Its output is an expression that can be loaded
+ * back as is, that is without relying on any globals. */
+
+static int is_keyword (const char *s, size_t n)
+{
+    static const char *keywords[] = {
+        "and", "break", "do", "else", "elseif", "end", "false", "for",
+        "function", "goto", "if", "in", "local", "nil", "not", "or",
+        "repeat", "return", "then", "true", "until", "while", NULL
+    };
+
+    const char **c;
+
+    for (c = keywords ; *c ; c += 1) {
+        if (strlen (*c) == n && !strncmp (*c, s, n)) {
+            return 1;
         }
     }
 
-    return 1;
+    return 0;
 }
 
-static void break_line ()
+static void source_string (luap_Describer *D, const char *s, size_t n)
 {
-    int i;
+    size_t i, m;
 
-    check_fit (indent + 1);
+    dump_literal (D, "\"");
 
-    /* Add a line break. */
+    for (i = 0 ; i < n ; i += 1) {
+        unsigned char c;
 
-    dump[offset] = '\n';
+        m = plain_span (s + i, n - i, '"', '\\');
+        dump_bytes (D, s + i, m);
+        i += m;
 
-    /* And indent to the current level. */
+        if (i == n) {
+            break;
+        }
 
-    for (i = 1 ; i <= indent ; i += 1) {
-        dump[offset + i] = ' ';
+        c = s[i];
+
+        if (c == '"' || c == '\\') {
+            dump_literal (D, "\\");
+            dump_character (D, c);
+        } else if (c == '\n') {
+            dump_literal (D, "\\n");
+        } else if (c == '\r') {
+            dump_literal (D, "\\r");
+        } else if (c == '\t') {
+            dump_literal (D, "\\t");
+        } else if (c < 0x20 || c == 0x7f) {
+            /* Always use three digits, in case a digit follows. */
+
+            dump_literal (D, "\\");
+            dump_decimal (D, c, 3);
+        } else {
+            dump_character (D, c);
+        }
     }
 
-    offset += indent + 1;
-    column = indent;
+    dump_literal (D, "\"");
 }
 
-static void dump_string (const char *s, int n)
+static void source_value (luap_Describer *D, lua_State *L, int index)
 {
-    int l;
-
-    /* Break the line if the current chunk doesn't fit but it would
-     * fit if we started on a fresh line at the current indent. */
+    const char *s;
+    lua_Number x;
+    long long n;
+    size_t m;
+
+    switch (lua_type (L, index)) {
+    case LUA_TNIL:
+        dump_literal (D, "nil");
+        break;
+    case LUA_TBOOLEAN:
+        if (lua_toboolean (L, index)) {
+            dump_literal (D, "true");
+        } else {
+            dump_literal (D, "false");
+        }
+        break;
+    case LUA_TNUMBER:
+        if (dump_as_integer (L, index, &n)) {
+            /* The most negative integer can't be written as a
+             * literal, as its absolute value would overflow. */
+
+            if (n == LLONG_MIN) {
+                dump_literal (D, "(-9223372036854775807-1)");
+            } else {
+                dump_integer (D, n);
+            }
 
-    l = width(s);
+            break;
+        }
 
-    if (column + l > linewidth && indent + l <= linewidth) {
-        break_line();
-    }
+        x = lua_tonumber (L, index);
 
-    check_fit (n);
+        if (x != x) {
+            dump_literal (D, "(0/0)");
+        } else if (x - x != 0) {
+            if (x > 0) {
+                dump_literal (D, "(1/0)");
+            } else {
+                dump_literal (D, "(-1/0)");
+            }
+        } else if (dump_float (D, x)) {
+            /* Make sure floats are read back as such. */
 
-    /* Copy the string to the buffer. */
+#if LUA_VERSION_NUM >= 503
+            dump_literal (D, ".0");
+#endif
+        }
+        break;
+    case LUA_TSTRING:
+        s = lua_tolstring (L, index, &m);
+        source_string (D, s, m);
+        break;
+    default:
+        fail (D, "cannot dump %s values", luaL_typename (L, index));
+    }
+}
 
-    memcpy (dump + offset, s, n);
-    dump[offset + n] = '\0';
+static void source_open (luap_Describer *D, int array, size_t n)
+{
+    dump_literal (D, "{");
+}
 
-    offset += n;
-    column += l;
+static void source_close (luap_Describer *D, int array, size_t n)
+{
+    dump_literal (D, "}");
 }
 
-static void describe (lua_State *L, int index)
+static void source_key (luap_Describer *D, lua_State *L, int table,
+                        int index, size_t i, int array, int positional)
 {
-    char *s;
+    const char *s;
     size_t n;
-    int type;
 
-    index = absolute (L, index);
-    type = lua_type (L, index);
+    if (i > 0) {
+        dump_literal (D, ",");
+    }
 
-    if (luaL_getmetafield (L, index, "__tostring")) {
-        lua_pushvalue (L, index);
-        lua_pcall (L, 1, 1, 0);
-        s = (char *)lua_tolstring (L, -1, &n);
-        lua_pop (L, 1);
+    if (positional) {
+        return;
+    }
 
-        dump_string (s, n);
-    } else if (type == LUA_TNUMBER) {
-        /* Copy the value to avoid mutating it. */
+    if (lua_type (L, index) == LUA_TSTRING) {
+        s = lua_tolstring (L, index, &n);
 
-        lua_pushvalue (L, index);
-        s = (char *)lua_tolstring (L, -1, &n);
-        lua_pop (L, 1);
+        if (n > 0 && is_identifier (s, n) && !is_keyword (s, n)) {
+            dump_bytes (D, s, n);
+            dump_literal (D, "=");
 
-        dump_string (s, n);
-    } else if (type == LUA_TSTRING) {
-        int i, started, score, level, uselevel = 0;
+            return;
+        }
+    }
 
-        s = (char *)lua_tolstring (L, index, &n);
+    dump_literal (D, "[");
+    source_value (D, L, index);
+    dump_literal (D, "]=");
+}
 
-        /* Scan the string to decide how to print it. */
+/* The MessagePack emitter. */
+
+static void pack (luap_Describer *D, int tag, unsigned long long n, int k)
+{
+    char t[9];
+    int i;
 
-        for (i = 0, score = n, started = 0 ; i < (int)n ; i += 1) {
-            if (s[i] == '\n' || s[i] == '\t' ||
-                s[i] == '\v' || s[i] == '\r') {
-                /* These characters show up better in a long sting so
-                 * bias towards that. */
+    /* Write a tag, followed by k bytes of n in big-endian order. */
 
-                score += linewidth / 2;
-            } else if (s[i] == '\a' || s[i] == '\b' ||
-                       s[i] == '\f' || !isprint(s[i])) {
-                /* These however go better with an escaped short
-                 * string (unless you like the bell or weird
-                 * characters). */
+    t[0] = tag;
 
-                score -= linewidth / 4;
-            }
+    for (i = 0 ; i < k ; i += 1) {
+        t[k - i] = (n >> (8 * i)) & 0xff;
+    }
 
-            /* Check what long string delimeter level to use so that
-             * the string won't be closed prematurely. */
+    dump_bytes (D, t, k + 1);
+}
 
-            if (!started) {
-                if (s[i] == ']') {
-                    started = 1;
-                    level = 0;
-                }
+static void pack_length (luap_Describer *D, int fixed, int limit, int tag,
+                         size_t n)
+{
+    /* Write the header of a string, array or map, using the fixed
+     * form for lengths below limit and 8, 16 or 32 bit lengths
+     * otherwise.  Arrays and maps have no 8 bit form, in which case
+     * tag is that of the 16 bit form minus one. */
+
+    if (n < (size_t)limit) {
+        pack (D, fixed | n, 0, 0);
+    } else if (n <= 0xff && limit == 32) {
+        pack (D, tag, n, 1);
+    } else if (n <= 0xffff) {
+        pack (D, tag + 1, n, 2);
+    } else if (n <= 0xffffffff) {
+        pack (D, tag + 2, n, 4);
+    } else {
+        fail (D, "cannot dump values this large as MessagePack", NULL);
+    }
+}
+
+static void msgpack_value (luap_Describer *D, lua_State *L, int index)
+{
+    const char *s;
+    union {
+        double x;
+        unsigned long long n;
+    } u;
+    long long n;
+    size_t m;
+
+    switch (lua_type (L, index)) {
+    case LUA_TNIL:
+        pack (D, 0xc0, 0, 0);
+        break;
+    case LUA_TBOOLEAN:
+        pack (D, lua_toboolean (L, index) ? 0xc3 : 0xc2, 0, 0);
+        break;
+    case LUA_TNUMBER:
+        if (!dump_as_integer (L, index, &n)) {
+            u.x = (double)lua_tonumber (L, index);
+            pack (D, 0xcb, u.n, 8);
+        } else if (n >= 0) {
+            if (n < 0x80) {
+                pack (D, n, 0, 0);
+            } else if (n <= 0xff) {
+                pack (D, 0xcc, n, 1);
+            } else if (n <= 0xffff) {
+                pack (D, 0xcd, n, 2);
+            } else if (n <= 0xffffffff) {
+                pack (D, 0xce, n, 4);
             } else {
-                if (s[i] == '=') {
-                    level += 1;
-                } else if (s[i] == ']') {
-                    if (level >= uselevel) {
-                        uselevel = level + 1;
-                    }
-                } else {
-                    started = 0;
-                }
+                pack (D, 0xcf, n, 8);
+            }
+        } else {
+            if (n >= -32) {
+                pack (D, n & 0xff, 0, 0);
+            } else if (n >= -0x80) {
+                pack (D, 0xd0, n, 1);
+            } else if (n >= -0x8000) {
+                pack (D, 0xd1, n, 2);
+            } else if (n >= -0x80000000LL) {
+                pack (D, 0xd2, n, 4);
+            } else {
+                pack (D, 0xd3, n, 8);
             }
         }
+        break;
+    case LUA_TSTRING:
+        s = lua_tolstring (L, index, &m);
+        pack_length (D, 0xa0, 32, 0xd9, m);
+        dump_bytes (D, s, m);
+        break;
+    default:
+        fail (D, "cannot dump %s values", luaL_typename (L, index));
+    }
+}
 
-        if (score > linewidth) {
-            /* Dump the string as a long string. */
+static void msgpack_open (luap_Describer *D, int array, size_t n)
+{
+    if (array) {
+        pack_length (D, 0x90, 16, 0xdb, n);
+    } else {
+        pack_length (D, 0x80, 16, 0xdd, n);
+    }
+}
 
-            dump_character ('[');
-            for (i = 0 ; i < uselevel ; i += 1) {
-                dump_character ('=');
-            }
-            dump_literal ("[\n");
+static void msgpack_close (luap_Describer *D, int array, size_t n)
+{
+}
 
-            dump_string (s, n);
+static void msgpack_key (luap_Describer *D, lua_State *L, int table,
+                         int index, size_t i, int array, int positional)
+{
+    if (!array) {
+        msgpack_value (D, L, index);
+    }
+}
 
-            dump_character (']');
-            for (i = 0 ; i < uselevel ; i += 1) {
-                dump_character ('=');
-            }
-            dump_literal ("]");
-        } else {
-            dump_literal ("\"");
+static const emitter emitters[] = {
+    {"json", json_value, json_open, json_close, json_key},
+    {"lua", source_value, source_open, source_close, source_key},
+    {"msgpack", msgpack_value, msgpack_open, msgpack_close, msgpack_key},
+    {NULL}
+};
 
-            for (i = 0 ; i < (int)n ; i += 1) {
-#ifdef ESCAPE_STRINGS
-                /* Escape the string as needed and print it as a normal
-                 * string. */
-
-                if (s[i] == '"' || s[i] == '\\') {
-                    dump_literal ("\\");
-                    dump_character (s[i]);
-                } else if (s[i] == '\a') {
-                    dump_literal ("\\a");
-                } else if (s[i] == '\b') {
-                    dump_literal ("\\b");
-                } else if (s[i] == '\f') {
-                    dump_literal ("\\f");
-                } else if (s[i] == '\n') {
-                    dump_literal ("\\n");
-                } else if (s[i] == '\r') {
-                    dump_literal ("\\r");
-                } else if (s[i] == '\t') {
-                    dump_literal ("\\t");
-                } else if (s[i] == '\v') {
-                    dump_literal ("\\v");
-                } else if (isprint(s[i])) {
-                    dump_character (s[i]);
-                } else {
-                    char t[5];
-                    size_t n;
+static void serialize (luap_Describer *D, const emitter *E, lua_State *L,
+                       int index)
+{
+    size_t i, l, m, n;
 
-                    n = sprintf (t, "\\%03u", ((unsigned char *)s)[i]);
-                    dump_string (t, n);
-                }
-#else
-                dump_character (s[i]);
-#endif
-            }
+    index = absolute (L, index);
 
-            dump_literal ("\"");
-        }
-    } else if (type == LUA_TNIL) {
-        n = asprintf (&s, "%snil%s", COLOR(7), COLOR(8));
-        dump_string (s, n);
-        free(s);
-    } else if (type == LUA_TBOOLEAN) {
-        n = asprintf (&s, "%s%s%s",
-                      COLOR(7),
-                      lua_toboolean (L, index) ? "true" : "false",
-                      COLOR(8));
-        dump_string (s, n);
-        free(s);
-    } else if (type == LUA_TFUNCTION) {
-        n = asprintf (&s, "<%sfunction:%s %p>",
-                      COLOR(7), COLOR(8), lua_topointer (L, index));
-        dump_string (s, n);
-        free(s);
-    } else if (type == LUA_TUSERDATA) {
-        n = asprintf (&s, "<%suserdata:%s %p>",
-                      COLOR(7), COLOR(8), lua_topointer (L, index));
+    if (D->error || D->status != 0) {
+        return;
+    }
 
-        dump_string (s, n);
-        free(s);
-    } else if (type == LUA_TTHREAD) {
-        n = asprintf (&s, "<%sthread:%s %p>",
-                      COLOR(7), COLOR(8), lua_topointer (L, index));
-        dump_string (s, n);
-        free(s);
-    } else if (type == LUA_TTABLE) {
-        int i, l, n, oldindent, multiline, nobreak;
+    if (lua_type (L, index) != LUA_TTABLE) {
+        E->value (D, L, index);
 
-        /* Check if table is too deeply nested. */
+        return;
+    }
 
-        if (indent > 8 * linewidth / 10) {
-            char *s;
-            size_t n;
+    if (D->level >= DUMP_MAX_LEVEL || !lua_checkstack (L, 4)) {
+        fail (D, "cannot dump tables nested this deeply", NULL);
 
-            n = asprintf (&s, "{ %s...%s }", COLOR(7), COLOR(8));
-            dump_string (s, n);
-            free(s);
+        return;
+    }
 
-            return;
-        }
+    /* Check for cycles, as in describe, and add the table to the
+     * ancestor set. */
 
-        /* Check if the table introduces a cycle by checking whether
-         * it is a back-edge (that is equal to an ancestor table. */
+    lua_rawgeti (L, LUA_REGISTRYINDEX, D->ancestors);
+    lua_pushvalue (L, index);
+    lua_rawget (L, -2);
 
-        lua_rawgeti (L, LUA_REGISTRYINDEX, ancestors);
-        n = lua_rawlen(L, -1);
+    if (!lua_isnil (L, -1)) {
+        fail (D, "cannot dump cyclic tables", NULL);
+        lua_pop (L, 2);
 
-        for (i = 0 ; i < n ; i += 1) {
-            lua_rawgeti (L, -1, n - i);
-#if LUA_VERSION_NUM == 501
-            if(lua_equal (L, -1, -3)) {
-#else
-            if(lua_compare (L, -1, -3, LUA_OPEQ)) {
-#endif
-                char *s;
-                size_t n;
+        return;
+    }
 
-                n = asprintf (&s, "{ %s[%d]...%s }",
-                              COLOR(7), -(i + 1), COLOR(8));
-                dump_string (s, n);
-                free(s);
-                lua_pop (L, 2);
+    lua_pop (L, 1);
+    lua_pushvalue (L, index);
+    lua_pushboolean (L, 1);
+    lua_rawset (L, -3);
+    lua_pop (L, 1);
 
-                return;
-            }
+    D->level += 1;
+
+    /* Find the length m of the run of positional keys and count the
+     * entries, as the length of tables comes first in some
+     * formats. */
+
+    l = lua_rawlen (L, index);
 
+    for (m = 0 ; m < l ; m += 1) {
+        lua_rawgeti (L, index, m + 1);
+
+        if (lua_isnil (L, -1)) {
             lua_pop (L, 1);
+            break;
         }
 
-        /* Add the table to the ancestor list and pop the ancestor
-         * list table. */
-
-        lua_pushvalue (L, index);
-        lua_rawseti (L, -2, n + 1);
         lua_pop (L, 1);
+    }
 
-        /* Open the table and update the indentation level to the
-         * current column. */
-
-        dump_literal ("{ ");
-        oldindent = indent;
-        indent = column;
-        multiline = 0;
-        nobreak = 0;
+    n = 0;
 
-        l = lua_rawlen (L, index);
+    lua_pushnil (L);
+    while (lua_next (L, index) != 0) {
+        n += 1;
+        lua_pop (L, 1);
+    }
 
-        /* Traverse the array part first. */
+    E->open (D, n == m, n);
 
-        for (i = 0 ; i < l ; i += 1) {
-            lua_pushinteger (L, i + 1);
-            lua_gettable (L, index);
+    /* Traverse the array part first and then the hash part. */
 
-            /* Start a fresh line when dumping tables to make sure
-             * there's plenty of room. */
+    for (i = 0 ; i < m && !D->error && D->status == 0 ; i += 1) {
+        lua_pushinteger (L, i + 1);
+        E->key (D, L, index, -1, i, n == m, 1);
+        lua_pop (L, 1);
 
-            if (lua_istable (L, -1)) {
-                if (!nobreak) {
-                    break_line();
-                }
+        lua_rawgeti (L, index, i + 1);
+        serialize (D, E, L, -1);
+        lua_pop (L, 1);
+    }
 
-                multiline = 1;
+    if (n > m) {
+        lua_pushnil (L);
+        while (lua_next (L, index) != 0) {
+            if (D->error || D->status != 0) {
+                lua_pop (L, 2);
+                break;
             }
 
-            nobreak = 0;
-
-            /* Dump the value and separating comma. */
-
-            describe (L, -1);
-            dump_literal (", ");
+            if (!in_array_part (L, -2, m)) {
+                if (lua_type (L, -2) == LUA_TTABLE) {
+                    fail (D, "cannot dump tables used as keys", NULL);
+                } else {
+                    E->key (D, L, index, -2, i, 0, 0);
+                    serialize (D, E, L, -1);
+                }
 
-            if (lua_istable (L, -1) && i != l - 1) {
-                break_line();
-                nobreak = 1;
+                i += 1;
             }
 
             lua_pop (L, 1);
         }
+    }
 
-        /* Now for the hash part. */
-
-        lua_pushnil (L);
-        while (lua_next (L, index) != 0) {
-            if (lua_type (L, -2) != LUA_TNUMBER ||
-                lua_tonumber (L, -2) != lua_tointeger (L, -2) ||
-                lua_tointeger (L, -2) < 1 ||
-                lua_tointeger (L, -2) > l) {
-
-                /* Keep each key-value pair on a separate line. */
-
-                break_line ();
-                multiline  = 1;
-
-                /* Dump the key and value. */
+    E->close (D, n == m, n);
 
-                if (lua_type (L, -2) == LUA_TSTRING) {
-                    char *s;
-                    size_t n;
+    /* Remove the table from the ancestor set. */
 
-                    s = (char *)lua_tolstring (L, -2, &n);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, D->ancestors);
+    lua_pushvalue (L, index);
+    lua_pushnil (L);
+    lua_rawset (L, -3);
+    lua_pop (L, 1);
 
-                    if(is_identifier (s, n)) {
-                        dump_string (COLOR(7), strlen(COLOR(7)));
-                        dump_string (s, n);
-                        dump_string (COLOR(8), strlen(COLOR(8)));
-                    } else {
-                        dump_literal ("[");
-                        describe (L, -2);
-                        dump_literal ("]");
-                    }
-                } else {
-                    dump_literal ("[");
-                    describe (L, -2);
-                    dump_literal ("]");
-                }
+    D->level -= 1;
+}
 
-                dump_literal (" = ");
-                describe (L, -1);
-                dump_literal (",");
-            }
+/* Dumping runs in protected mode too, for the same reasons as
+ * describing. */
 
-            lua_pop (L, 1);
-        }
+static int dump_protected (lua_State *L)
+{
+    luap_Describer *D;
 
-        /* Remove the table from the ancestor list. */
+    D = (luap_Describer *)lua_touserdata (L, 1);
 
-        lua_rawgeti (L, LUA_REGISTRYINDEX, ancestors);
-        lua_pushnil (L);
-        lua_rawseti (L, -2, n + 1);
-        lua_pop (L, 1);
+    lua_newtable (L);
+    D->ancestors = luaL_ref (L, LUA_REGISTRYINDEX);
 
-        /* Pop the indentation level. */
+    serialize (D, (const emitter *)lua_touserdata (L, 2), L, 3);
 
-        indent = oldindent;
+    luaL_unref (L, LUA_REGISTRYINDEX, D->ancestors);
+    D->ancestors = LUA_NOREF;
 
-        if (multiline) {
-            break_line();
-            dump_literal ("}");
-        } else {
-            dump_literal (" }");
-        }
-    }
+    return 0;
 }
 
-char *luap_describe (lua_State *L, int index)
+int luap_dump_ex (luap_Describer *D, lua_State *L, int index,
+                  const char *format, luap_Writer w, void *ud)
 {
-    int oldcolorize;
+    const emitter *E;
 
-#ifdef HAVE_IOCTL
-    struct winsize w;
+    for (E = emitters ; E->name && strcmp (E->name, format) ; E += 1);
 
-    /* Initialize the state. */
+    if (!E->name) {
+        lua_pushfstring (L, "unknown format '%s'", format);
 
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) < 0) {
-        linewidth = 80;
-    } else {
-        linewidth = w.ws_col;
+        return -1;
     }
-#else
-    linewidth = 80;
-#endif
 
     index = absolute (L, index);
-    offset = 0;
-    indent = 0;
-    column = 0;
+    trim_dump (D);
+    D->writer = w;
+    D->writer_data = ud;
+    D->busy = 1;
+    D->offset = 0;
+    D->flushed = 0;
+    D->column = 0;
+    D->indent = 0;
+    D->spaced = 0;
+    D->status = 0;
+    D->error = NULL;
+    D->ancestors = LUA_NOREF;
+    D->visited = LUA_NOREF;
+    reset_describer (D, L);
+
+    lua_pushcfunction (L, dump_protected);
+    lua_pushlightuserdata (L, D);
+    lua_pushlightuserdata (L, (void *)E);
+    lua_pushvalue (L, index);
+
+    if (lua_pcall (L, 3, 0, 0) != LUA_OK) {
+        /* Leave the error message on the stack. */
+
+        reset_describer (D, L);
+
+        D->writer = NULL;
+        D->busy = 0;
+
+        return -1;
+    }
 
-    /* Suppress colorization, to avoid escape sequences in the
-     * returned strings. */
+    flush_dump (D);
 
-    oldcolorize = colorize;
-    colorize = 0;
+    D->writer = NULL;
+    D->busy = 0;
 
-    /* Create a table to hold the ancestors for checking for cycles
-     * when printing table hierarchies. */
+    if (D->error) {
+        lua_pushfstring (L, D->error, D->culprit);
 
-    lua_newtable (L);
-    ancestors = luaL_ref (L, LUA_REGISTRYINDEX);
+        return -1;
+    } else if (D->status != 0) {
+        lua_pushliteral (L, "could not write dump");
+    }
+
+    return D->status;
+}
+
+int luap_dump (lua_State *L, int index, const char *format, luap_Writer w,
+               void *ud)
+{
+    luap_Describer d;
+    int status;
 
-    describe (L, index);
+    if (!describer.busy) {
+        return luap_dump_ex (&describer, L, index, format, w, ud);
+    }
 
-    luaL_unref (L, LUA_REGISTRYINDEX, ancestors);
-    colorize = oldcolorize;
+    luap_initdescriber (&d);
+    status = luap_dump_ex (&d, L, index, format, w, ud);
+    luap_cleardescriber (&d);
 
-    return dump;
+    return status;
 }
 
 /* These are custom commands. */
@@ -1402,8 +5979,9 @@ static int describe_stack (int count, int key)
         i = h + count + 1;
 
         if (i > 0 && i <= h) {
-            print_output ("\nValue at stack index %d(%d):\n%s%s",
-                          i, -h + i - 1, COLOR(3), luap_describe (M, i));
+            print_output ("\nValue at stack index %d(%d):\n%s",
+                          i, -h + i - 1, COLOR(3));
+            luap_describe_to (M, i, luap_filewriter, stdout);
         } else {
             print_error ("Invalid stack index.\n");
         }
@@ -1425,6 +6003,25 @@ static int describe_stack (int count, int key)
 
     return 0;
 }
+
+static int expand_handle (int count, int key)
+{
+    print_output ("%s", COLOR(7));
+
+    if (luap_expand (M, count)) {
+        print_output ("\nTable #%d:\n%s", count, COLOR(3));
+        luap_describe_to (M, -1, luap_filewriter, stdout);
+        lua_pop (M, 1);
+    } else {
+        print_error ("Invalid handle.\n");
+    }
+
+    print_output ("%s\n", COLOR(0));
+
+    rl_on_new_line ();
+
+    return 0;
+}
 #endif
 
 int luap_call (lua_State *L, int n) {
@@ -1510,6 +6107,17 @@ void luap_sethistory(lua_State *L, const char *file)
     }
 }
 
+void luap_setmoduleindex(lua_State *L, const char *file)
+{
+    if (file) {
+        indexfile = realloc (indexfile, strlen(file) + 1);
+        strcpy (indexfile, file);
+    } else if (indexfile) {
+        free(indexfile);
+        indexfile = NULL;
+    }
+}
+
 void luap_setcolor(lua_State *L, int enable)
 {
     /* Don't allow color if we're not writing to a terminal. */
@@ -1521,6 +6129,46 @@ void luap_setcolor(lua_State *L, int enable)
     }
 }
 
+void luap_setlimits(lua_State *L, int entries, int depth, int string,
+                    int total, int steps)
+{
+    describer.max_entries = entries > 0 ? entries : 0;
+    describer.max_depth = depth > 0 ? depth : 0;
+    describer.max_string = string > 0 ? string : 0;
+    describer.max_total = total > 0 ? total : 0;
+    describer.max_steps = steps > 0 ? steps : 0;
+}
+
+void luap_setreferences(lua_State *L, int enable)
+{
+    describer.references = enable;
+}
+
+void luap_setroundtrip(lua_State *L, int enable)
+{
+    describer.roundtrip = enable;
+}
+
+void luap_setraw(lua_State *L, int enable)
+{
+    describer.raw = enable;
+}
+
+void luap_setcolumnar(lua_State *L, int enable)
+{
+    describer.columnar = enable;
+}
+
+void luap_setcollapse(lua_State *L, int depth)
+{
+    describer.collapse = depth > 0 ? depth : 0;
+}
+
+void luap_setpager(lua_State *L, int enable)
+{
+    pager = enable;
+}
+
 void luap_setname(lua_State *L, const char *name)
 {
     chunkname = (char *)realloc (chunkname, strlen(name) + 2);
@@ -1549,11 +6197,56 @@ void luap_gethistory(lua_State *L, const char **file)
     *file = logfile;
 }
 
+void luap_getmoduleindex(lua_State *L, const char **file)
+{
+    *file = indexfile;
+}
+
 void luap_getcolor(lua_State *L, int *enabled)
 {
     *enabled = colorize;
 }
 
+void luap_getlimits(lua_State *L, int *entries, int *depth, int *string,
+                    int *total, int *steps)
+{
+    *entries = describer.max_entries;
+    *depth = describer.max_depth;
+    *string = describer.max_string;
+    *total = describer.max_total;
+    *steps = describer.max_steps;
+}
+
+void luap_getreferences(lua_State *L, int *enabled)
+{
+    *enabled = describer.references;
+}
+
+void luap_getroundtrip(lua_State *L, int *enabled)
+{
+    *enabled = describer.roundtrip;
+}
+
+void luap_getraw(lua_State *L, int *enabled)
+{
+    *enabled = describer.raw;
+}
+
+void luap_getcolumnar(lua_State *L, int *enabled)
+{
+    *enabled = describer.columnar;
+}
+
+void luap_getcollapse(lua_State *L, int *depth)
+{
+    *depth = describer.collapse;
+}
+
+void luap_getpager(lua_State *L, int *enabled)
+{
+    *enabled = pager;
+}
+
 void luap_getname(lua_State *L, const char **name)
 {
     *name = chunkname + 1;
@@ -1581,6 +6274,7 @@ void luap_enter(lua_State *L)
         rl_completion_display_matches_hook = display_matches;
 
         rl_add_defun ("lua-describe-stack", describe_stack, META('s'));
+        rl_add_defun ("lua-expand-handle", expand_handle, META('e'));
 #endif
 
 #ifdef HAVE_READLINE_HISTORY
@@ -1598,6 +6292,14 @@ void luap_enter(lua_State *L)
             luap_setprompts (L, ">  ", ">> ");
         }
 
+#if defined(HAVE_LIBREADLINE) && defined(COMPLETE_MODULES) && \
+    defined(DISCOVER_MODULES)
+        /* Start listing the module directories in the background,
+         * so that they're ready by the time they're needed. */
+
+        start_discovery ();
+#endif
+
         atexit (finish);
 
         initialized = 1;
@@ -1678,6 +6380,7 @@ void luap_enter(lua_State *L)
         /* Done reading the line, restore old handler. */
 
         sigaction(SIGINT, &oldsigint, NULL);
+        generation += 1;
 
         if (*line == '\0') {
             free(line);
@@ -24,6 +24,8 @@
 #ifndef _PROMPT_H_
 #define _PROMPT_H_
 
+#include <signal.h>
+
 #include <lualib.h>
 #include <lauxlib.h>
 
@@ -32,17 +34,96 @@
 void luap_setprompts(lua_State *L, const char *single, const char *multi);
 void luap_setpromptfuncs(lua_State *L);
 void luap_sethistory(lua_State *L, const char *file);
+void luap_setmoduleindex(lua_State *L, const char *file);
 void luap_setname(lua_State *L, const char *name);
 void luap_setcolor(lua_State *L, int enable);
+void luap_setlimits(lua_State *L, int entries, int depth, int string,
+                    int total, int steps);
+void luap_setreferences(lua_State *L, int enable);
+void luap_setroundtrip(lua_State *L, int enable);
+void luap_setraw(lua_State *L, int enable);
+void luap_setcolumnar(lua_State *L, int enable);
+void luap_setcollapse(lua_State *L, int depth);
+void luap_setpager(lua_State *L, int enable);
 
 void luap_getprompts(lua_State *L, const char **single, const char **multi);
 void luap_getpromptfuncs(lua_State *L);
 void luap_gethistory(lua_State *L, const char **file);
+void luap_getmoduleindex(lua_State *L, const char **file);
 void luap_getcolor(lua_State *L, int *enabled);
+void luap_getlimits(lua_State *L, int *entries, int *depth, int *string,
+                    int *total, int *steps);
+void luap_getreferences(lua_State *L, int *enabled);
+void luap_getroundtrip(lua_State *L, int *enabled);
+void luap_getraw(lua_State *L, int *enabled);
+void luap_getcolumnar(lua_State *L, int *enabled);
+void luap_getcollapse(lua_State *L, int *depth);
+void luap_getpager(lua_State *L, int *enabled);
 void luap_getname(lua_State *L, const char **name);
 
+typedef int (*luap_Writer) (const char *s, size_t n, void *ud);
+
+typedef struct luap_Describer {
+    /* These are the options.  A zero line width means the width of
+     * the terminal.  Each of the output budgets is ignored if zero.
+     * If interrupt is set, the description is cut short as soon as
+     * the flag it points to becomes non-zero.  If roundtrip is set,
+     * floats are shown with as many digits as needed to read them
+     * back exactly.  If raw is set, tables are read without
+     * consulting their __index metamethod.  If columnar is set,
+     * arrays of records are shown in columns.  If collapse is
+     * non-zero, non-empty tables nested that deep are shown as
+     * handles, which can be expanded via luap_expand. */
+
+    int linewidth, colorize, references, roundtrip, raw, columnar, collapse;
+    int max_entries, max_depth, max_string, max_total, max_steps;
+    volatile sig_atomic_t *interrupt;
+
+    /* The rest is private. */
+
+    luap_Writer writer;
+    void *writer_data;
+    char *dump;
+    size_t length, offset, flushed;
+    int columns, indent, column, spaced, level, status, exhausted;
+    int interrupted;
+    unsigned long steps;
+    int ancestors, visited, labels, busy;
+    struct luap_Group *groups;
+    struct luap_Break *breaks;
+    int ngroups, maxgroups, nbreaks, maxbreaks, pending;
+    long long *keys;
+    int nkeys, maxkeys;
+    const char *error, *culprit;
+} luap_Describer;
+
+typedef void (*luap_DescribeFunction) (luap_Describer *D, lua_State *L,
+                                       int index);
+
+void luap_register_describer (lua_State *L, int index,
+                              luap_DescribeFunction f);
+void luap_describer_text (luap_Describer *D, const char *s, size_t n);
+void luap_describer_open (luap_Describer *D);
+void luap_describer_field (luap_Describer *D, lua_State *L, const char *key,
+                           int index);
+void luap_describer_close (luap_Describer *D);
+
 void luap_enter(lua_State *L);
+int luap_expand (lua_State *L, int handle);
 char *luap_describe (lua_State *L, int index);
+int luap_describe_to (lua_State *L, int index, luap_Writer writer, void *ud);
+void luap_initdescriber (luap_Describer *D);
+int luap_describe_ex (luap_Describer *D, lua_State *L, int index,
+                      luap_Writer writer, void *ud);
+void luap_cleardescriber (luap_Describer *D);
+int luap_dump (lua_State *L, int index, const char *format,
+               luap_Writer writer, void *ud);
+int luap_dump_ex (luap_Describer *D, lua_State *L, int index,
+                  const char *format, luap_Writer writer, void *ud);
 int luap_call (lua_State *L, int n);
 
+int luap_filewriter (const char *s, size_t n, void *ud);
+int luap_fdwriter (const char *s, size_t n, void *ud);
+int luap_bufferwriter (const char *s, size_t n, void *ud);
+
 #endif